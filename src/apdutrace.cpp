@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "apdutrace.h"
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QElapsedTimer>
+#include <QDateTime>
+#include <QDataStream>
+#include <QSaveFile>
+#include <QSettings>
+#include <QVector>
+
+#include <cstring>
+
+struct TraceEvent {
+    QString reader;
+    qint64 start = 0;
+    qint64 duration = 0;
+    quint32 result = 0;
+    quint16 sw = 0;
+    quint16 commandSize = 0;
+    quint16 responseSize = 0;
+    quint8 commandStored = 0;
+    quint8 responseStored = 0;
+    char command[APDUTrace::TRACE_BYTES];
+    char response[APDUTrace::TRACE_BYTES];
+};
+
+const int APDUTrace::TRACE_BYTES;
+
+static QMutex traceMutex;
+static QVector<TraceEvent> ring;
+static int traceNext = 0; // slot for the next event
+static int traceCount = 0;
+static bool initialized = false;
+static bool responses = false; // response data is stored, not only the SW
+
+static QElapsedTimer &traceClock() {
+    static QElapsedTimer timer;
+    static bool started = (timer.start(), true);
+    Q_UNUSED(started);
+    return timer;
+}
+
+qint64 APDUTrace::now() {
+    return traceClock().nsecsElapsed();
+}
+
+// Capacity in events, 0 disables the trace
+static void initialize() {
+    initialized = true;
+    QSettings settings;
+    int size = settings.value("apduTraceSize", 1024).toInt();
+    responses = settings.value("apduTraceResponses", false).toBool();
+    ring.resize(qMax(size, 0));
+}
+
+// PIN-s are in the data of these
+static bool isSensitive(const QByteArray &command) {
+    if (command.size() < 2)
+        return false;
+    quint8 ins = quint8(command.at(1));
+    return ins == 0x20 || ins == 0x21 || ins == 0x24 || ins == 0x2C;
+}
+
+void APDUTrace::record(const QString &reader, qint64 start, const QByteArray &command, const QByteArray &response, long result) {
+    qint64 end = now();
+    QMutexLocker locker(&traceMutex);
+    if (!initialized) {
+        initialize();
+    }
+    if (ring.isEmpty()) {
+        return;
+    }
+    TraceEvent &e = ring[traceNext];
+    traceNext = (traceNext + 1) % ring.size();
+    traceCount = qMin(traceCount + 1, ring.size());
+
+    e.reader = reader;
+    e.start = start;
+    e.duration = end - start;
+    e.result = quint32(result);
+    e.sw = response.size() >= 2 ? quint16((quint8(response.at(response.size() - 2)) << 8) | quint8(response.at(response.size() - 1))) : 0;
+    e.commandSize = quint16(qMin(command.size(), 0xFFFF));
+    e.commandStored = quint8(qMin(command.size(), isSensitive(command) ? 4 : TRACE_BYTES));
+    memcpy(e.command, command.constData(), e.commandStored);
+    e.responseSize = quint16(qMin(response.size(), 0xFFFF));
+    e.responseStored = responses ? quint8(qMin(response.size(), TRACE_BYTES)) : 0;
+    memcpy(e.response, response.constData(), e.responseStored);
+}
+
+QByteArray APDUTrace::snapshot() {
+    QByteArray result;
+    QDataStream out(&result, QIODevice::WriteOnly);
+    out.setByteOrder(QDataStream::BigEndian);
+    out.writeRawData("WEIDTRC1", 8);
+
+    QMutexLocker locker(&traceMutex);
+    out << quint32(1) << qint64(QDateTime::currentMSecsSinceEpoch()) << now() << quint32(traceCount);
+    // Oldest first
+    int first = ring.isEmpty() ? 0 : (traceNext - traceCount + ring.size()) % ring.size();
+    for (int i = 0; i < traceCount; i++) {
+        const TraceEvent &e = ring.at((first + i) % ring.size());
+        QByteArray name = e.reader.toUtf8();
+        out << quint16(name.size());
+        out.writeRawData(name.constData(), name.size());
+        out << e.start << e.duration << e.result << e.sw;
+        out << e.commandSize << e.commandStored;
+        out.writeRawData(e.command, e.commandStored);
+        out << e.responseSize << e.responseStored;
+        out.writeRawData(e.response, e.responseStored);
+    }
+    return result;
+}
+
+bool APDUTrace::exportTo(const QString &path) {
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    file.write(snapshot());
+    return file.commit();
+}
+
+bool APDUTrace::parse(const QByteArray &data, QList<Exchange> &exchanges) {
+    if (!data.startsWith("WEIDTRC1"))
+        return false;
+    QDataStream in(data.mid(8));
+    in.setByteOrder(QDataStream::BigEndian);
+    quint32 version = 0, events = 0;
+    qint64 wallclock = 0, monotonic = 0;
+    in >> version >> wallclock >> monotonic >> events;
+    if (version != 1)
+        return false;
+    for (quint32 i = 0; i < events && in.status() == QDataStream::Ok; i++) {
+        Exchange e;
+        quint16 length = 0, sw = 0, commandSize = 0, responseSize = 0;
+        quint8 stored = 0;
+        QByteArray name;
+        in >> length;
+        name.resize(length);
+        in.readRawData(name.data(), length);
+        e.reader = QString::fromUtf8(name);
+        in >> e.start >> e.duration >> e.result >> sw;
+        in >> commandSize >> stored;
+        if (stored > commandSize)
+            return false;
+        e.command.resize(stored);
+        in.readRawData(e.command.data(), stored);
+        e.command.append(QByteArray(commandSize - stored, 0));
+        in >> responseSize >> stored;
+        if (stored > responseSize)
+            return false;
+        e.response.resize(stored);
+        in.readRawData(e.response.data(), stored);
+        if (responseSize > stored) {
+            e.response.append(QByteArray(responseSize - stored, 0));
+            // SW is at the end
+            if (responseSize >= 2) {
+                e.response[responseSize - 2] = char(sw >> 8);
+                e.response[responseSize - 1] = char(sw & 0xFF);
+            }
+        }
+        exchanges.append(e);
+    }
+    return in.status() == QDataStream::Ok;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include <QString>
+#include <QByteArray>
+#include <QList>
+
+/*
+ Always-on trace of APDU-s, kept in a fixed size ring in memory.
+
+ Recording copies at most TRACE_BYTES of the command and the response into
+ preallocated slots, so it does not allocate nor hold on to the receive
+ buffers. Data of PIN commands (VERIFY, CHANGE REFERENCE DATA and RESET
+ RETRY COUNTER) is never recorded, only the header.
+
+ Settings, read once: "apduTraceSize" is the capacity in events (1024, 0
+ disables). Responses are recorded as their length and SW only, unless
+ "apduTraceResponses" is true, as the data is card content of every origin.
+
+ Exported on demand from the tray debug menu only, to the desktop. The format is binary, big endian, and can be
+ replayed with the simulator:
+
+ "WEIDTRC1"
+ u32 version (1), i64 current time in ms since epoch, i64 monotonic ns at export, u32 count
+ count times:
+   u16 length, reader name in UTF-8
+   i64 monotonic ns at send, i64 duration ns, u32 PC/SC result, u16 SW (0 if none)
+   u16 command length, u8 stored, stored bytes
+   u16 response length, u8 stored, stored bytes
+*/
+class APDUTrace {
+public:
+    static const int TRACE_BYTES = 64;
+
+    // An exported event, with the command and the response in their original
+    // length. Bytes that were not stored are zeroes, the SW is kept.
+    struct Exchange {
+        QString reader;
+        qint64 start = 0;
+        qint64 duration = 0;
+        quint32 result = 0;
+        QByteArray command;
+        QByteArray response;
+    };
+    static bool parse(const QByteArray &data, QList<Exchange> &exchanges);
+
+    // Monotonic timestamp in nanoseconds
+    static qint64 now();
+    // Called from the reader threads
+    static void record(const QString &reader, qint64 start, const QByteArray &command, const QByteArray &response, long result);
+    // Serialized snapshot, the ring is kept
+    static QByteArray snapshot();
+    static bool exportTo(const QString &path);
+};
@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QJsonDocument>
+#include <QLocalSocket>
+#include <QProcess>
+#include <QProcessEnvironment>
+#include <QStandardPaths>
+#include <QDir>
+#include <QThread>
+#include <QTimer>
+#include <QUuid>
+#include <QWebSocket>
+#include <QTemporaryFile>
+#include <QFileInfo>
+#include <QJsonObject>
+
+#include "../apdutrace.h"
+#include "../framing.h"
+
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+
+/*
+ Round-trip latency of the app transports, against simulated readers.
+
+ web-eid-bench --app ../web-eid --simulate ../../tests/simulated.json
+
+ launches the app with simulated readers and drives SCardConnect,
+ SCardTransmit and SCardDisconnect over the WebSocket and the local socket,
+ reporting percentiles and throughput. Without --app an already running
+ app (started with --simulate) is used.
+
+ web-eid-bench --app ../web-eid --replay web-eid-trace.bin [--zero-latency]
+
+ replays an exported APDU trace against simulated cards that answer from
+ the trace, and reports the time the host side adds on top of the card time.
+*/
+
+static const char *benchOrigin = "https://bench.web-eid.com";
+
+// One request at a time, like a browser context
+class Client: public QObject {
+    Q_OBJECT
+
+public:
+    Client(bool local): local(local) {
+        if (local) {
+            connect(&ls, &QLocalSocket::readyRead, this, [this] {
+                frames.read(&ls);
+                QByteArray msg;
+                while (frames.next(msg))
+                    received(msg);
+            });
+            connect(&ls, &QLocalSocket::disconnected, &loop, &QEventLoop::quit);
+        } else {
+            connect(&ws, &QWebSocket::textMessageReceived, this, [this] (const QString &message) {
+                received(message.toUtf8());
+            });
+            connect(&ws, &QWebSocket::connected, &loop, &QEventLoop::quit);
+            connect(&ws, &QWebSocket::disconnected, &loop, &QEventLoop::quit);
+        }
+    }
+
+    bool open(int timeout) {
+        if (local) {
+            ls.connectToServer(serverName());
+            return ls.waitForConnected(timeout);
+        }
+        ws.open(QUrl(QStringLiteral("ws://127.0.0.1:59735")));
+        QTimer timer;
+        timer.setSingleShot(true);
+        connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+        timer.start(timeout);
+        loop.exec();
+        return ws.state() == QAbstractSocket::ConnectedState;
+    }
+
+    void close() {
+        if (local) {
+            ls.disconnectFromServer();
+        } else {
+            ws.close();
+        }
+    }
+
+    // Send a message and wait for the reply with the same id
+    QVariantMap transact(QVariantMap message, int timeout = 10000) {
+        id = QUuid::createUuid().toString();
+        message["id"] = id;
+        response.clear();
+        if (local)
+            message["origin"] = benchOrigin; // implied by the WebSocket
+        QByteArray msg = QJsonDocument::fromVariant(message).toJson(QJsonDocument::Compact);
+        if (local) {
+            writeFrame(&ls, msg);
+        } else {
+            ws.sendTextMessage(QString::fromUtf8(msg));
+        }
+        QTimer timer;
+        timer.setSingleShot(true);
+        connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+        timer.start(timeout);
+        if (response.isEmpty())
+            loop.exec();
+        if (response.isEmpty())
+            response["error"] = "timeout";
+        return response;
+    }
+
+    static QString serverName() {
+#if defined(Q_OS_MACOS)
+        return QDir("/tmp").filePath(qgetenv("USER") + "-webeid");
+#elif defined(Q_OS_WIN32)
+        return qgetenv("USERNAME").simplified().replace(" ", "_") + "-webeid";
+#else
+        return QDir(QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation)).filePath("webeid-socket");
+#endif
+    }
+
+private:
+    void received(const QByteArray &msg) {
+        QVariantMap json = QJsonDocument::fromJson(msg).toVariant().toMap();
+        if (json.value("id").toString() == id) {
+            response = json;
+            loop.quit();
+        }
+    }
+
+    bool local;
+    QWebSocket ws{QString::fromLatin1(benchOrigin)};
+    QLocalSocket ls;
+    FrameReader frames{64 * 1024 * 1024};
+    QEventLoop loop;
+    QString id;
+    QVariantMap response;
+};
+
+struct Result {
+    std::vector<qint64> samples; // nanoseconds
+    qint64 elapsed = 0; // nanoseconds, for all samples
+    int errors = 0;
+};
+
+static double percentile(const std::vector<qint64> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+    return sorted[i] / 1000.0;
+}
+
+// Returns the p99 in microseconds
+static double report(const char *transport, const char *operation, Result &r) {
+    std::sort(r.samples.begin(), r.samples.end());
+    double p99 = percentile(r.samples, 0.99);
+    double rate = r.elapsed > 0 ? r.samples.size() * 1e9 / r.elapsed : 0;
+    printf("%-6s %-16s n=%-6d p50=%9.1fus p99=%9.1fus p999=%9.1fus %9.0f msg/s errors=%d\n", transport, operation,
+           int(r.samples.size()), percentile(r.samples, 0.5), p99, percentile(r.samples, 0.999), rate, r.errors);
+    fflush(stdout);
+    return p99;
+}
+
+static bool timed(Client &client, const QVariantMap &message, Result &result, QElapsedTimer &clock) {
+    qint64 start = clock.nsecsElapsed();
+    QVariantMap response = client.transact(message);
+    qint64 duration = clock.nsecsElapsed() - start;
+    result.elapsed += duration;
+    if (response.contains("error")) {
+        result.errors++;
+        return false;
+    }
+    result.samples.push_back(duration);
+    return true;
+}
+
+// Runs the benchmark over one transport, returns the worst p99 in microseconds or -1 on failure
+static double bench(bool local, const QString &reader, const QByteArray &apdu, int rounds, int cycles) {
+    const char *name = local ? "local" : "ws";
+    Client client(local);
+    if (!client.open(10000)) {
+        printf("%-6s could not connect\n", name);
+        return -1;
+    }
+    QVariantMap connect{{"SCardConnect", QVariantMap{{"reader", reader}, {"protocol", "*"}}}};
+    QVariantMap transmit{{"SCardTransmit", QVariantMap{{"reader", reader}, {"bytes", QString(apdu.toBase64())}}}};
+    QVariantMap disconnect{{"SCardDisconnect", QVariantMap{{"reader", reader}}}};
+    QElapsedTimer clock;
+    clock.start();
+    double worst = 0;
+
+    // Transmits on an open connection
+    QVariantMap connected = client.transact(connect);
+    if (connected.contains("error")) {
+        printf("%-6s SCardConnect failed: %s\n", name, qPrintable(connected.value("error").toString()));
+        return -1;
+    }
+    Result warmup;
+    for (int i = 0; i < 10; i++) {
+        timed(client, transmit, warmup, clock);
+    }
+    Result transmits;
+    for (int i = 0; i < rounds; i++) {
+        timed(client, transmit, transmits, clock);
+    }
+    client.transact(disconnect);
+    worst = std::max(worst, report(name, "SCardTransmit", transmits));
+
+    // Connection setup and teardown
+    Result connects, disconnects;
+    for (int i = 0; i < cycles; i++) {
+        if (timed(client, connect, connects, clock)) {
+            timed(client, disconnect, disconnects, clock);
+        }
+    }
+    worst = std::max(worst, report(name, "SCardConnect", connects));
+    worst = std::max(worst, report(name, "SCardDisconnect", disconnects));
+    client.close();
+    if (transmits.errors || connects.errors || disconnects.errors)
+        return -1;
+    return worst;
+}
+
+// Replays the trace over one transport, returns the p99 of the overhead in microseconds or -1 on failure
+static double replay(bool local, const QList<APDUTrace::Exchange> &trace, bool zeroLatency) {
+    const char *name = local ? "local" : "ws";
+    Client client(local);
+    if (!client.open(10000)) {
+        printf("%-6s could not connect\n", name);
+        return -1;
+    }
+    QElapsedTimer clock;
+    clock.start();
+    Result overhead;
+    qint64 cardTime = 0, totalTime = 0;
+    QStringList connected;
+    for (const auto &e: trace) {
+        if (e.result != 0)
+            continue; // Not in the simulation
+        if (!connected.contains(e.reader)) {
+            QVariantMap response = client.transact({{"SCardConnect", QVariantMap{{"reader", e.reader}, {"protocol", "*"}}}});
+            if (response.contains("error")) {
+                printf("%-6s SCardConnect to %s failed: %s\n", name, qPrintable(e.reader), qPrintable(response.value("error").toString()));
+                return -1;
+            }
+            connected.append(e.reader);
+        }
+        QVariantMap transmit{{"SCardTransmit", QVariantMap{{"reader", e.reader}, {"bytes", QString(e.command.toBase64())}}}};
+        qint64 start = clock.nsecsElapsed();
+        QVariantMap response = client.transact(transmit);
+        qint64 duration = clock.nsecsElapsed() - start;
+        if (response.contains("error")) {
+            overhead.errors++;
+            continue;
+        }
+        qint64 card = zeroLatency ? 0 : e.duration;
+        cardTime += card;
+        totalTime += duration;
+        overhead.elapsed += duration;
+        overhead.samples.push_back(std::max(qint64(0), duration - card));
+    }
+    for (const auto &reader: connected) {
+        client.transact({{"SCardDisconnect", QVariantMap{{"reader", reader}}}});
+    }
+    client.close();
+    double p99 = report(name, "host overhead", overhead);
+    printf("%-6s card %.1fms, total %.1fms, host %.1fms (%.1f%%)\n", name, cardTime / 1e6, totalTime / 1e6,
+           (totalTime - cardTime) / 1e6, totalTime > 0 ? (totalTime - cardTime) * 100.0 / totalTime : 0);
+    fflush(stdout);
+    return overhead.errors ? -1 : p99;
+}
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Web eID transport latency benchmark");
+    parser.addHelpOption();
+    QCommandLineOption appOption("app", "Launch the app from <path>", "path");
+    QCommandLineOption simulateOption("simulate", "Simulation for the launched app", "file");
+    QCommandLineOption readerOption("reader", "Simulated reader to use", "name", "Simulated Reader 0");
+    QCommandLineOption apduOption("apdu", "APDU to transmit, in hex", "hex", "00A4040000");
+    QCommandLineOption roundsOption("rounds", "Number of transmits", "n", "1000");
+    QCommandLineOption cyclesOption("cycles", "Number of connects and disconnects", "n", "100");
+    QCommandLineOption transportOption("transport", "ws, local or both", "transport", "both");
+    QCommandLineOption maxOption("max-p99", "Fail if any p99 is above <us>", "us");
+    QCommandLineOption replayOption("replay", "Replay an exported APDU trace", "file");
+    QCommandLineOption zeroOption("zero-latency", "Replay without the recorded card time");
+    parser.addOptions({appOption, simulateOption, readerOption, apduOption, roundsOption, cyclesOption, transportOption, maxOption, replayOption, zeroOption});
+    parser.process(app);
+
+    QList<APDUTrace::Exchange> trace;
+    QTemporaryFile simulation;
+    if (parser.isSet(replayOption)) {
+        QFile f(parser.value(replayOption));
+        if (!f.open(QIODevice::ReadOnly) || !APDUTrace::parse(f.readAll(), trace)) {
+            printf("Could not read trace %s\n", qPrintable(parser.value(replayOption)));
+            return 1;
+        }
+        // The launched app answers from the same trace
+        QJsonObject config{{"trace", QFileInfo(f).absoluteFilePath()}, {"traceLatency", !parser.isSet(zeroOption)}};
+        if (!simulation.open()) {
+            printf("Could not create simulation\n");
+            return 1;
+        }
+        simulation.write(QJsonDocument(config).toJson());
+        simulation.flush();
+    }
+
+    QProcess process;
+    if (parser.isSet(appOption)) {
+        if (!parser.isSet(simulateOption) && !parser.isSet(replayOption)) {
+            printf("--app requires --simulate or --replay\n");
+            return 1;
+        }
+        QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+        if (!env.contains("QT_QPA_PLATFORM"))
+            env.insert("QT_QPA_PLATFORM", "offscreen"); // No tray or dialogs needed
+        process.setProcessEnvironment(env);
+        process.setProcessChannelMode(QProcess::ForwardedChannels);
+        process.start(parser.value(appOption), {"--simulate", parser.isSet(replayOption) ? simulation.fileName() : parser.value(simulateOption)});
+        if (!process.waitForStarted()) {
+            printf("Could not start %s\n", qPrintable(parser.value(appOption)));
+            return 1;
+        }
+        // Wait for the servers to listen
+        for (int i = 0; i < 50; i++) {
+            QLocalSocket probe;
+            probe.connectToServer(Client::serverName());
+            if (probe.waitForConnected(100) || process.state() != QProcess::Running)
+                break;
+            QThread::msleep(100);
+        }
+        if (process.state() != QProcess::Running) {
+            printf("App exited with %d\n", process.exitCode());
+            return 1;
+        }
+    }
+
+    QString transport = parser.value(transportOption);
+    QString reader = parser.value(readerOption);
+    QByteArray apdu = QByteArray::fromHex(parser.value(apduOption).toLatin1());
+    int rounds = parser.value(roundsOption).toInt();
+    int cycles = parser.value(cyclesOption).toInt();
+
+    double worst = 0;
+    bool failed = false;
+    bool zeroLatency = parser.isSet(zeroOption);
+    if (transport == "ws" || transport == "both") {
+        double p99 = trace.isEmpty() ? bench(false, reader, apdu, rounds, cycles) : replay(false, trace, zeroLatency);
+        failed |= p99 < 0;
+        worst = std::max(worst, p99);
+    }
+    if (transport == "local" || transport == "both") {
+        double p99 = trace.isEmpty() ? bench(true, reader, apdu, rounds, cycles) : replay(true, trace, zeroLatency);
+        failed |= p99 < 0;
+        worst = std::max(worst, p99);
+    }
+
+    if (process.state() == QProcess::Running) {
+        // Ask the app to quit over the local socket
+        QLocalSocket ls;
+        ls.connectToServer(Client::serverName());
+        if (ls.waitForConnected(1000)) {
+            QByteArray msg = QJsonDocument::fromVariant(QVariantMap{{"internal", "quit"}}).toJson(QJsonDocument::Compact);
+            writeFrame(&ls, msg);
+            ls.waitForBytesWritten(1000);
+        }
+        if (!process.waitForFinished(5000)) {
+            process.kill();
+            process.waitForFinished();
+        }
+    }
+
+    if (failed)
+        return 1;
+    if (parser.isSet(maxOption) && worst > parser.value(maxOption).toDouble()) {
+        printf("p99 of %.1fus is above %sus\n", worst, qPrintable(parser.value(maxOption)));
+        return 2;
+    }
+    return 0;
+}
+
+#include "bench.moc"
@@ -0,0 +1,16 @@
+OBJECTS_DIR = build
+MOC_DIR = build
+RCC_DIR = build
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+QT += network websockets
+QT -= gui
+macx {
+    QMAKE_MACOSX_DEPLOYMENT_TARGET = 10.9
+}
+win32 {
+    DEFINES += WIN32_LEAN_AND_MEAN
+}
+TARGET = web-eid-bench
+SOURCES += bench.cpp ../apdutrace.cpp
@@ -8,66 +8,82 @@
 #include <QJsonObject>
 #include <QJsonDocument>
 #include <QtConcurrent>
+#include <QSettings>
+#include <QtEndian>
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+#include <QCborValue>
+#include <QCborMap>
+#endif
 
 #include "main.h" // for parent
+#include "qpcscsim.h"
 
 #include "dialogs/select_reader.h"
 
+// Byte values are kept as QByteArray in messages. They are base64 in JSON
+// and byte strings in CBOR.
+static QVariant toJson(const QVariant &value) {
+    if (value.type() == QVariant::ByteArray)
+        return QString::fromLatin1(value.toByteArray().toBase64());
+    if (value.type() == QVariant::List) {
+        QVariantList result;
+        for (const auto &v: value.toList())
+            result.append(toJson(v));
+        return result;
+    }
+    if (value.type() == QVariant::Map) {
+        QVariantMap result;
+        const QVariantMap map = value.toMap();
+        for (auto i = map.constBegin(); i != map.constEnd(); ++i)
+            result.insert(i.key(), toJson(i.value()));
+        return result;
+    }
+    return value;
+}
+
+static QByteArray bytes(const QVariant &value) {
+    if (value.type() == QVariant::ByteArray)
+        return value.toByteArray();
+    return QByteArray::fromBase64(value.toString().toLatin1());
+}
+
+// Major type 5, any length
+static bool isCborMap(const QByteArray &msg) {
+    return !msg.isEmpty() && (quint8(msg.at(0)) & 0xE0) == 0xA0;
+}
+
+static QVariantMap decode(const QByteArray &msg, bool cbor) {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    if (cbor && isCborMap(msg))
+        return QCborValue::fromCbor(msg).toMap().toVariantMap();
+#else
+    Q_UNUSED(cbor);
+#endif
+    return QJsonDocument::fromJson(msg).toVariant().toMap();
+}
+
 WebContext::WebContext(QObject *parent, QLocalSocket *client): QObject(parent)  {
     this->ls = client;
     connect(client, &QLocalSocket::readyRead, this, [this, client] {
         _log("Handling data from local socket");
         _log("Available: %d", client->bytesAvailable());
-        quint32 msgsize = 0;
-        if (client->bytesAvailable() < qint64(sizeof(msgsize) + 1)) {
-            return;
+        frames.read(client);
+        // Drain every complete frame, a partial one waits for the next signal
+        QByteArray msg;
+        while (frames.next(msg)) {
+            _log("Read message of %d bytes", msg.size());
+            processFrame(msg);
+            if (client->state() != QLocalSocket::ConnectedState)
+                return;
         }
-        if (client->read((char*)&msgsize, sizeof(msgsize)) == sizeof(msgsize)) {
-            _log("Read message size: %d bytes", msgsize);
-            QByteArray msg(int(msgsize), 0);
-            quint64 numread = client->read(msg.data(), msgsize);
-            if (numread == msgsize) {
-                _log("Read message of %d bytes", msgsize);
-                // Make JSON
-                QVariantMap json = QJsonDocument::fromJson(msg).toVariant().toMap();
-
-                // re-serialize msg
-                QByteArray response =  QJsonDocument::fromVariant(json).toJson();
-                _log("Read message:\n%s", response.constData());
-
-                // Handle internal messages
-                if (json.contains("internal")) {
-                    if (json["internal"] == "quit") {
-                        return QApplication::quit();
-                    }
-                }
-                // Check for mandatory fields
-                if (!json.contains("origin") || !json.contains("id")) {
-                    _log("No id or origin, terminating");
-                    terminate();
-                }
-
-                // Check origin
-                if (origin.isEmpty()) {
-                    origin = json.value("origin").toString();
-                } else {
-                    if (origin != json.value("origin").toString()) {
-                        _log("Origin mismatch, terminating");
-                        terminate();
-                    }
-                }
-                processMessage(json);
-            } else {
-                _log("Could not read message, read %d of %d", numread, msgsize);
-                terminate();
-            }
-        } else {
-            _log("Could not read message size");
-            terminate();
+        if (frames.failed()) {
+            _log("Bad message size, terminating");
+            return terminate();
         }
     });
     connect(client, &QLocalSocket::disconnected, this, [this, client] {
         _log("Local client disconnected (%s)", qPrintable(this->origin));
+        abandon();
         emit disconnected();
     });
     // Save references to PKI and PCSC
@@ -75,6 +91,50 @@ WebContext::WebContext(QObject *parent, QLocalSocket *client): QObject(parent)
     PKI = &((QtHost *)parent)->PKI;
 }
 
+void WebContext::processFrame(const QByteArray &msg) {
+    QVariantMap json = decode(msg, cbor);
+
+    // re-serialize msg
+    if (Logger::isEnabled()) {
+        QByteArray response = QJsonDocument::fromVariant(toJson(json)).toJson();
+        _log("Read message:\n%s", response.constData());
+    }
+
+    // Handle internal messages. Only the first frame comes from web-eid-bridge
+    // itself, the rest are browser messages passed as they are
+    bool first = handshake;
+    handshake = false;
+    if (json.contains("internal")) {
+        if (!first) {
+            _log("Internal message from the browser, terminating");
+            return terminate();
+        }
+        if (json["internal"] == "quit") {
+            return QApplication::quit();
+        } else if (json["internal"] == "browser") {
+            browser = json.value("browser").toString();
+            _log("Browser is %s", qPrintable(browser));
+        }
+        return;
+    }
+    // Check for mandatory fields
+    if (!json.contains("origin") || !json.contains("id")) {
+        _log("No id or origin, terminating");
+        return terminate();
+    }
+
+    // Check origin
+    if (origin.isEmpty()) {
+        origin = json.value("origin").toString();
+    } else {
+        if (origin != json.value("origin").toString()) {
+            _log("Origin mismatch, terminating");
+            return terminate();
+        }
+    }
+    processMessage(json);
+}
+
 WebContext::WebContext(QObject *parent, QWebSocket *client): QObject(parent) {
     this->ws = client;
     this->origin = client->origin();
@@ -83,18 +143,38 @@ WebContext::WebContext(QObject *parent, QWebSocket *client): QObject(parent) {
         QVariantMap json = QJsonDocument::fromJson(message.toUtf8()).toVariant().toMap();
         if (!json.contains("id")) {
             _log("No id, terminating");
-            terminate();
+            return terminate();
         }
         // re-serialize msg
-        QByteArray response =  QJsonDocument::fromVariant(json).toJson();
-        _log("Read message: %s", response.constData());
+        if (Logger::isEnabled()) {
+            QByteArray response = QJsonDocument::fromVariant(json).toJson();
+            _log("Read message: %s", response.constData());
+        }
 
         // Add origin for uniform message processing
         json["origin"] = origin;
         processMessage(json);
     });
+    connect(client, &QWebSocket::binaryMessageReceived, this, [this] (const QByteArray &frame) {
+        // CBOR messages are maps, binary opcodes are never in 0xA0..0xBF
+        if (cbor && isCborMap(frame)) {
+            QVariantMap json = decode(frame, cbor);
+            if (!json.contains("id")) {
+                _log("No id, terminating");
+                return terminate();
+            }
+            json["origin"] = origin;
+            return processMessage(json);
+        }
+        if (!binary) {
+            _log("Binary frame before negotiation, terminating");
+            return terminate();
+        }
+        processBinary(frame);
+    });
     connect(client, &QWebSocket::disconnected, this, [this, client] {
         _log("%s disconnected", qPrintable(client->origin()));
+        abandon();
         emit disconnected();
     });
 
@@ -103,16 +183,54 @@ WebContext::WebContext(QObject *parent, QWebSocket *client): QObject(parent) {
     PKI = &((QtHost *)parent)->PKI;
 }
 
-// Process a message from a browsing context, one by one
+// Parse a list of APDU script steps. Conditions may only refer to earlier steps
+static bool parseScript(const QVariantList &list, QList<APDUStep> &script) {
+    for (const auto &v: list) {
+        const QVariantMap s = v.toMap();
+        APDUStep step;
+        bool ok = true;
+        int index = script.size();
+        step.bytes = bytes(s.value("bytes"));
+        if (step.bytes.size() < 4)
+            return false;
+        if (s.contains("expect"))
+            step.sw = s.value("expect").toString().toUShort(&ok, 16);
+        if (ok && s.contains("mask"))
+            step.mask = s.value("mask").toString().toUShort(&ok, 16);
+        if (!ok)
+            return false;
+        step.when = s.value("if", -1).toInt();
+        step.unless = s.value("unless", -1).toInt();
+        step.abort = s.value("abort", false).toBool();
+        if (step.when >= index || step.unless >= index)
+            return false;
+        if (s.contains("count")) {
+            const QVariantMap count = s.value("count").toMap();
+            step.countStep = count.value("step", -1).toInt();
+            step.countOffset = count.value("offset", 0).toInt();
+            step.countSize = count.value("size", 1).toInt();
+            step.countInto = count.value("into", -1).toInt();
+            if (step.countStep < 0 || step.countStep >= index || step.countOffset < 0 || (step.countSize != 1 && step.countSize != 2))
+                return false;
+        }
+        script.append(step);
+    }
+    return !script.isEmpty();
+}
+
+// Process a message from a browsing context. Several requests can be
+// in flight, replies are matched by id
 void WebContext::processMessage(const QVariantMap &message) {
     _log("Processing message");
     QVariantMap resp;
 
-    // Current message ID
-    if (!msgid.isEmpty()) {
-        return outgoing({{"error", "protocol"}});
+    const QString id = message.value("id").toString();
+    // "binary:" ids are taken by binary frames
+    if (requests.contains(id) || id.startsWith(QLatin1String("binary:"))) {
+        _log("Request %s already in flight", qPrintable(id));
+        return send({{"id", id}, {"error", "protocol"}});
     }
-    msgid = message.value("id").toString();
+    requests.insert(id);
 
     // Origin. If unset for context, set
     // Check if origin is secure
@@ -144,50 +262,80 @@ void WebContext::processMessage(const QVariantMap &message) {
 
     timer.setSingleShot(true);
     timer.start(5000); // 5 seconds
+
+    // PKI operations share the signals, one at a time
+    if (message.contains("sign") || message.contains("certificate") || message.contains("authenticate")) {
+        if (!pki.isEmpty())
+            return outgoing(id, {{"error", "protocol"}});
+        pki = id;
+    }
+
     // Command dispatch
     if (message.contains("version")) {
-        return outgoing({{"id", msgid}, {"version", VERSION}});
+        return outgoing(id, {{"version", VERSION}});
+    } else if (message.contains("binary")) {
+        // Only the WebSocket has binary frames
+        binary = ws && message.value("binary").toBool();
+        return outgoing(id, {{"binary", binary}});
+    } else if (message.contains("cbor")) {
+        // Replies after this one are CBOR, requests may be either.
+        // Not through web-eid-bridge, browsers only take JSON from it
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+        bool enable = browser.isEmpty() && message.value("cbor").toBool();
+#else
+        bool enable = false;
+#endif
+        outgoing(id, {{"cbor", enable}});
+        cbor = enable;
+        return;
     } else if (message.contains("SCardConnect")) {
         auto params = message.value("SCardConnect").toMap();
+        // One reader selection at a time
+        if (!connecting.isEmpty())
+            return outgoing(id, {{"error", "protocol"}});
+        connecting = id;
         // Show reader selection or confirmation dialog
         // to avoid races for card reader resources
         QList<QByteArray> atrs;
         if (params.contains("atrs")) {
             for (const auto &a: params.value("atrs").toList()) {
-                atrs.append(QByteArray::fromBase64(a.toString().toLatin1()));
+                atrs.append(bytes(a));
             }
         }
-        dialog = new QtSelectReader(this, PCSC, atrs); // FIXME
-        if (params.contains("timeout")) {
-            timer.setSingleShot(true);
-            timer.setInterval(params.value("timeout", 60).toInt() * 1000); // FIXME: define "infinity"
-            connect(&timer, &QTimer::timeout, dialog, &QDialog::reject);
-        }
-        PKI->pause();
-        ((QtSelectReader *)dialog)->update(PCSC->getReaders());
-        connect(dialog, &QDialog::rejected, this, [=] {
-            PKI->resume();
-            outgoing({{"error", QtPCSC::errorName(SCARD_E_CANCELLED)}});
-        });
         // Connect to the reader once the reader name is known
-        connect((QtSelectReader *)dialog, &QtSelectReader::readerSelected, this, [this, params] (QString name) {
-            QPCSCReader *r = PCSC->connectReader(this, name, params.value("protocol", "*").toString(), true);
+        auto open = [this, params, id] (QString name) {
+            connecting.clear();
+            QPCSCOptions options;
+            options.autoResponse = params.value("autoResponse", false).toBool();
+            options.origin = origin;
+            options.keepWarm = QSettings().value("warmCardTimeout", 0).toInt();
+            options.implicitTransaction = params.value("implicitTransaction", true).toBool();
+            options.logicalChannels = params.value("logicalChannel", false).toBool();
+            QPCSCReader *r = PCSC->connectReader(this, name, params.value("protocol", "*").toString(), options, true);
+            if (!r) {
+                PKI->resume();
+                return outgoing(id, {{"error", QtPCSC::errorName(SCARD_E_UNKNOWN_READER)}});
+            }
             readers[name] = r;
+            pending[name].enqueue(id);
             connect(r, &QPCSCReader::disconnected, this, [this, name] (LONG err) {
                 _log("Disconnected: %s", QtPCSC::errorName(err));
                 PKI->resume();
                 if (readers.contains(name)) {
                     QPCSCReader *rd = readers.take(name);
                     // If disconnect happens in between of messages (eg dialog cancel)
-                    // error will be given on next incoming message
-                    if (!msgid.isEmpty()) {
+                    // there is nobody to tell. TODO: store lasterror
+                    // The first waiting request caused it, the rest are not handled any more
+                    QQueue<QString> ids = pending.take(name);
+                    if (!ids.isEmpty()) {
                         if (err != SCARD_S_SUCCESS) {
-                            outgoing({{"error", QtPCSC::errorName(err)}});
+                            outgoing(ids.dequeue(), {{"error", QtPCSC::errorName(err)}});
                         } else {
-                            outgoing({});
+                            outgoing(ids.dequeue(), {});
                         }
-                    } else {
-                        // TODO: store lasterror
+                    }
+                    for (const auto &i: ids) {
+                        outgoing(i, {{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
                     }
                     rd->deleteLater();
                 } else {
@@ -197,67 +345,181 @@ void WebContext::processMessage(const QVariantMap &message) {
             connect(r, &QPCSCReader::connected, this, [=] (QByteArray atr, QString proto) {
                 _log("connected: %s %s", qPrintable(proto), qPrintable(atr.toHex()));
                 PKI->resume();
-                outgoing({{"name", name}, {"protocol", proto}, {"atr", atr.toBase64()}});
+                QVariantMap msg{{"name", name}, {"protocol", proto}, {"atr", atr}};
+                if (binary) {
+                    if (!indexes.contains(name) && indexes.size() < 0x100)
+                        indexes.append(name);
+                    if (indexes.contains(name))
+                        msg["index"] = indexes.indexOf(name);
+                }
+                reply(name, msg);
             });
+            connect(r, &QPCSCReader::reconnected, this, [=] (QByteArray atr, QString proto) {
+                _log("reconnected: %s %s", qPrintable(proto), qPrintable(atr.toHex()));
+                reply(name, {{"protocol", proto}, {"atr", atr}});
+            });
+            connect(r, &QPCSCReader::fileRead, this, [=] (QByteArray data, quint16 sw) {
+                _log("Read file of %d bytes: %04X", data.size(), sw);
+                if (sw != 0x9000) {
+                    return reply(name, {{"error", "card"}, {"sw", QString("%1").arg(sw, 4, 16, QChar('0')).toUpper()}});
+                }
+                reply(name, {{"bytes", data}});
+            });
+            // Explicit transactions
+            auto done = [=] (LONG err) {
+                if (err != SCARD_S_SUCCESS) {
+                    return reply(name, {{"error", QtPCSC::errorName(err)}});
+                }
+                reply(name, {});
+            };
+            connect(r, &QPCSCReader::transactionStarted, this, done);
+            connect(r, &QPCSCReader::transactionEnded, this, done);
             connect(r, &QPCSCReader::received, this, [=] (QByteArray apdu) {
                 _log("Received apdu");
-                outgoing({{"bytes", apdu.toBase64()}});
+                reply(name, {{"bytes", apdu}});
+            });
+            connect(r, &QPCSCReader::receivedBatch, this, [=] (QList<QByteArray> responses) {
+                _log("Received %d apdus", responses.size());
+                QVariantList result;
+                for (const auto &apdu: responses) {
+                    result.append(apdu);
+                }
+                reply(name, {{"bytes", result}});
             });
+            connect(r, &QPCSCReader::receivedScript, this, [=] (QList<QByteArray> responses, int aborted) {
+                _log("Script done with %d responses", responses.size());
+                QVariantList result;
+                for (const auto &apdu: responses) {
+                    // Skipped steps have no response
+                    result.append(apdu.isEmpty() ? QVariant() : QVariant(apdu));
+                }
+                QVariantMap msg;
+                msg["bytes"] = result;
+                if (aborted >= 0)
+                    msg["aborted"] = aborted;
+                reply(name, msg);
+            });
+        };
+        PKI->pause();
+        // Simulated readers are named by the client, for unattended tests
+        if (QPCSCSimulator::isActive() && params.contains("reader")) {
+            return open(params.value("reader").toString());
+        }
+        dialog = new QtSelectReader(this, PCSC, atrs); // FIXME
+        if (params.contains("timeout")) {
+            timer.setSingleShot(true);
+            timer.setInterval(params.value("timeout", 60).toInt() * 1000); // FIXME: define "infinity"
+            connect(&timer, &QTimer::timeout, dialog, &QDialog::reject);
+        }
+        ((QtSelectReader *)dialog)->update(PCSC->getReaders());
+        connect(dialog, &QDialog::rejected, this, [=] {
+            PKI->resume();
+            connecting.clear();
+            outgoing(id, {{"error", QtPCSC::errorName(SCARD_E_CANCELLED)}});
         });
+        connect((QtSelectReader *)dialog, &QtSelectReader::readerSelected, this, open);
     } else if (message.contains("SCardDisconnect")) {
         auto params = message.value("SCardDisconnect").toMap();
         if (!params.contains("reader"))
-            return outgoing({{"error", "protocol"}});
+            return outgoing(id, {{"error", "protocol"}});
         if (!readers.contains(params.value("reader").toString()))
-            return outgoing({{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
+            return outgoing(id, {{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
         QPCSCReader *r = readers[params.value("reader").toString()];
+        pending[r->name].enqueue(id);
         r->disconnect();
     } else if (message.contains("SCardTransmit")) {
         auto params = message.value("SCardTransmit").toMap();
-        if (!params.contains("reader") || !params.contains("bytes"))
-            return outgoing({{"error", "protocol"}});
+        if (!params.contains("reader") || !(params.contains("bytes") || params.contains("script")))
+            return outgoing(id, {{"error", "protocol"}});
         if (!readers.contains(params.value("reader").toString()))
-            return outgoing({{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
+            return outgoing(id, {{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
         QPCSCReader *r = readers[params.value("reader").toString()];
-        r->transmit(QByteArray::fromBase64(params.value("bytes").toString().toLatin1()));
+        // A script is run in the reader thread and answered with a list of responses
+        if (params.contains("script")) {
+            QList<APDUStep> script;
+            if (!parseScript(params.value("script").toList(), script))
+                return outgoing(id, {{"error", "protocol"}});
+            pending[r->name].enqueue(id);
+            r->runScript(script);
+        } else if (params.value("bytes").type() == QVariant::List) {
+            // A list of APDU-s is sent back-to-back and answered with a list of responses
+            QList<QByteArray> apdus;
+            for (const auto &a: params.value("bytes").toList()) {
+                apdus.append(bytes(a));
+            }
+            if (apdus.isEmpty())
+                return outgoing(id, {{"error", "protocol"}});
+            pending[r->name].enqueue(id);
+            r->transmitBatch(apdus);
+        } else {
+            pending[r->name].enqueue(id);
+            r->transmit(bytes(params.value("bytes")));
+        }
     } else if (message.contains("SCardReconnect")) {
         auto params = message.value("SCardReconnect").toMap();
         if (!params.contains("reader") || !params.contains("protocol"))
-            return outgoing({{"error", "protocol"}});
+            return outgoing(id, {{"error", "protocol"}});
         if (!readers.contains(params.value("reader").toString()))
-            return outgoing({{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
+            return outgoing(id, {{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
         QPCSCReader *r = readers[params.value("reader").toString()];
+        pending[r->name].enqueue(id);
         r->reconnect(params.value("protocol").toString());
+    } else if (message.contains("readFile")) {
+        // The whole EF in one round trip, {reader, path or fid, chunk}
+        auto params = message.value("readFile").toMap();
+        QByteArray path = QByteArray::fromHex(params.value(params.contains("path") ? "path" : "fid").toString().toLatin1());
+        int chunk = params.value("chunk", 0xE7).toInt();
+        if (!params.contains("reader") || path.isEmpty() || path.size() % 2 || chunk < 1 || chunk > 0xFFFF)
+            return outgoing(id, {{"error", "protocol"}});
+        if (!readers.contains(params.value("reader").toString()))
+            return outgoing(id, {{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
+        QPCSCReader *r = readers[params.value("reader").toString()];
+        pending[r->name].enqueue(id);
+        r->readFile(path, chunk);
+    } else if (message.contains("SCardBeginTransaction") || message.contains("SCardEndTransaction")) {
+        bool begin = message.contains("SCardBeginTransaction");
+        auto params = message.value(begin ? "SCardBeginTransaction" : "SCardEndTransaction").toMap();
+        if (!params.contains("reader"))
+            return outgoing(id, {{"error", "protocol"}});
+        if (!readers.contains(params.value("reader").toString()))
+            return outgoing(id, {{"error", QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE)}});
+        QPCSCReader *r = readers[params.value("reader").toString()];
+        pending[r->name].enqueue(id);
+        if (begin) {
+            r->beginTransaction();
+        } else {
+            r->endTransaction();
+        }
     } else if (message.contains("sign")) {
         QVariantMap params = message.value("sign").toMap();
         if (!params.contains("certificate") || !params.contains("hash"))
-            return outgoing({{"error", "protocol"}});
-        const QByteArray cert = QByteArray::fromBase64(params.value("certificate").toString().toLatin1());
-        const QByteArray hash = QByteArray::fromBase64(params.value("hash").toString().toLatin1());
-        connect(PKI, &QPKI::signature, this, [this] (const WebContext *context, const CK_RV result, const QByteArray &value) {
+            return outgoing(id, {{"error", "protocol"}});
+        const QByteArray cert = bytes(params.value("certificate"));
+        const QByteArray hash = bytes(params.value("hash"));
+        connect(PKI, &QPKI::signature, this, [this, id] (const WebContext *context, const CK_RV result, const QByteArray &value) {
             if (this != context) {
                 _log("Not us, ignore");
                 return;
             }
             disconnect(PKI, &QPKI::signature, this, 0);
             if (result == CKR_OK) {
-                outgoing({{"signature", value.toBase64()}});
+                outgoing(id, {{"signature", value}});
             } else {
-                outgoing({{"error", QPKI::errorName(result)}});
+                outgoing(id, {{"error", QPKI::errorName(result)}});
             }
         });
         PKI->sign(this, cert, hash, QStringLiteral("SHA-256"), Signing); // FIXME: signature
     } else if (message.contains("certificate")) {
-        connect(PKI, &QPKI::certificate, this, [this] (const WebContext *context, const CK_RV result, const QByteArray &value) {
+        connect(PKI, &QPKI::certificate, this, [this, id] (const WebContext *context, const CK_RV result, const QByteArray &value) {
             if (this != context) {
                 _log("Not us, ignore");
                 return;
             }
             disconnect(PKI, &QPKI::certificate, this, 0);
             if (result == CKR_OK) {
-                outgoing({{"certificate", value.toBase64()}});
+                outgoing(id, {{"certificate", value}});
             } else {
-                outgoing({{"error", QPKI::errorName(result)}});
+                outgoing(id, {{"error", QPKI::errorName(result)}});
             }
         });
         PKI->select(this, Signing);
@@ -265,7 +527,7 @@ void WebContext::processMessage(const QVariantMap &message) {
         QVariantMap auth = message.value("authenticate").toMap();
 
         // TODO: Select certificate if needed
-        connect(PKI, &QPKI::certificate, this, [this, auth] (const WebContext *context, const CK_RV result, const QByteArray &value) {
+        connect(PKI, &QPKI::certificate, this, [this, auth, id] (const WebContext *context, const CK_RV result, const QByteArray &value) {
             const QString nonce = auth.value("nonce").toString().toLatin1();
             if (this != context) {
                 _log("Not us, ignore");
@@ -276,7 +538,7 @@ void WebContext::processMessage(const QVariantMap &message) {
                 // We have the certificate
                 QByteArray jwt_token = QPKI::authenticate_dtbs(QSslCertificate(value, QSsl::Der), context->origin, nonce);
                 QByteArray hash = QCryptographicHash::hash(jwt_token, QCryptographicHash::Sha256);
-                connect(PKI, &QPKI::signature, this, [this, jwt_token] (const WebContext* ctx, const CK_RV rv, const QByteArray& val) {
+                connect(PKI, &QPKI::signature, this, [this, jwt_token, id] (const WebContext* ctx, const CK_RV rv, const QByteArray& val) {
                     if (this != ctx) {
                         _log("Not us, ignore");
                         return;
@@ -284,37 +546,113 @@ void WebContext::processMessage(const QVariantMap &message) {
                     disconnect(PKI, &QPKI::signature, this, 0);
                     if (rv == CKR_OK) {
                         QByteArray token = jwt_token + "." + val.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
-                        outgoing({{"token", QString(token)}, {"type", "JWT"}});
+                        outgoing(id, {{"token", QString(token)}, {"type", "JWT"}});
                     } else {
-                        outgoing({{"error", QPKI::errorName(rv)}});
+                        outgoing(id, {{"error", QPKI::errorName(rv)}});
                     }
                 });
                 PKI->sign(this, value, hash, QStringLiteral("SHA-256"), Authentication);
             } else {
-                outgoing({{"error", QPKI::errorName(result)}});
+                outgoing(id, {{"error", QPKI::errorName(result)}});
             }
         });
         PKI->select(this, Authentication);
     } else {
-        outgoing({{"error", "protocol"}});
+        outgoing(id, {{"error", "protocol"}});
+    }
+}
+
+// Reply to the oldest request waiting for the reader
+void WebContext::reply(const QString &reader, const QVariantMap &message) {
+    if (pending.value(reader).isEmpty()) {
+        _log("No request waiting for %s", qPrintable(reader));
+        return;
     }
+    outgoing(pending[reader].dequeue(), message);
 }
 
-void WebContext::outgoing(QVariantMap message) {
-    message["id"] = msgid;
-    msgid.clear();
+void WebContext::outgoing(const QString &id, QVariantMap message) {
+    requests.remove(id);
+    if (pki == id)
+        pki.clear();
+    if (binaryRequests.contains(id)) {
+        quint8 index = binaryRequests.take(id);
+        quint32 number = id.mid(id.indexOf(':') + 1).toUInt();
+        if (message.contains("error")) {
+            return sendBinary(BinaryError, index, number, message.value("error").toString().toUtf8());
+        }
+        return sendBinary(BinaryResponse, index, number, message.value("bytes").toByteArray());
+    }
+    message["id"] = id;
+    send(message);
+}
 
-    QByteArray response = QJsonDocument::fromVariant(message).toJson(QJsonDocument::Compact);
-    QByteArray logmsg = QJsonDocument::fromVariant(message).toJson();
-    _log("Sending outgoing message:\n%s", logmsg.constData());
+void WebContext::send(const QVariantMap &message) {
+    if (Logger::isEnabled()) {
+        QByteArray logmsg = QJsonDocument::fromVariant(toJson(message)).toJson();
+        _log("Sending outgoing message:\n%s", logmsg.constData());
+    }
+#if QT_VERSION >= QT_VERSION_CHECK(5, 12, 0)
+    if (cbor) {
+        // Same length prefixed frames on the local socket, binary frames on the WebSocket
+        QByteArray response = QCborMap::fromVariantMap(message).toCborValue().toCbor();
+        if (this->ls) {
+            writeFrame(ls, response);
+        } else if (this->ws) {
+            ws->sendBinaryMessage(response);
+        }
+        return;
+    }
+#endif
+    QByteArray response = QJsonDocument::fromVariant(toJson(message)).toJson(QJsonDocument::Compact);
     if (this->ls) {
-        quint32 msgsize = response.size();
-        ls->write((char *)&msgsize, sizeof(msgsize));
-        ls->write(response);
+        writeFrame(ls, response);
     } else if(this->ws) {
         ws->sendTextMessage(QString(response));
     } else {
-        _log("Do not know where to send a reply for %s", qPrintable(msgid));
+        _log("Do not know where to send a reply for %s", qPrintable(message.value("id").toString()));
+    }
+}
+
+void WebContext::processBinary(const QByteArray &frame) {
+    if (frame.size() < 6) {
+        _log("Short binary frame, terminating");
+        return terminate();
+    }
+    quint8 opcode = quint8(frame.at(0));
+    quint8 index = quint8(frame.at(1));
+    quint32 number = qFromBigEndian<quint32>(reinterpret_cast<const uchar *>(frame.constData() + 2));
+    const QString id = QStringLiteral("binary:%1").arg(number);
+    if (requests.contains(id)) {
+        _log("Request %s already in flight", qPrintable(id));
+        return sendBinary(BinaryError, index, number, "protocol");
+    }
+    if (opcode != BinaryTransmit) {
+        return sendBinary(BinaryError, index, number, "protocol");
+    }
+    if (index >= indexes.size() || !readers.contains(indexes.at(index))) {
+        return sendBinary(BinaryError, index, number, QtPCSC::errorName(SCARD_E_READER_UNAVAILABLE));
+    }
+    requests.insert(id);
+    binaryRequests[id] = index;
+    QPCSCReader *r = readers[indexes.at(index)];
+    pending[r->name].enqueue(id);
+    r->transmit(frame.mid(6));
+}
+
+void WebContext::sendBinary(quint8 opcode, quint8 index, quint32 id, const QByteArray &payload) {
+    QByteArray frame(6, 0);
+    frame[0] = char(opcode);
+    frame[1] = char(index);
+    qToBigEndian<quint32>(id, reinterpret_cast<uchar *>(frame.data() + 2));
+    frame.append(payload);
+    ws->sendBinaryMessage(frame);
+}
+
+// Nobody is waiting for the card work any more
+void WebContext::abandon() {
+    for (auto r: readers) {
+        r->abandon();
     }
 }
 
@@ -10,6 +10,12 @@
 #include <QUuid>
 #include <QTimer>
 #include <QFutureWatcher>
+#include <QQueue>
+#include <QSet>
+#include <QHash>
+#include <QStringList>
+
+#include "framing.h"
 
 class QtPCSC;
 class QPCSCReader;
@@ -36,20 +42,47 @@ public:
 
     // Any running UI widget, associated with the context
     QDialog *dialog = nullptr;
-    void outgoing(QVariantMap message); // So that main.cpp could send version on connect
+    void outgoing(const QString &id, QVariantMap message); // So that main.cpp could send version on connect
 
 signals:
     void disconnected();
 
 private:
     void processMessage(const QVariantMap &message); // Message received from client
+    void processFrame(const QByteArray &msg); // Frame received from the local socket
+    void reply(const QString &reader, const QVariantMap &message);
+    void send(const QVariantMap &message);
+    void abandon();
+
+    // Binary frames on the WebSocket, enabled with {"binary": true}:
+    // u8 opcode, u8 reader index, u32 request id (big endian), payload.
+    // Opcode 0x01 transmits the APDU in the payload to the reader with the
+    // index given in the SCardConnect reply. The reply has the same header
+    // with opcode 0x81 and the response as payload, or 0xFF and the error name.
+    enum BinaryOpcode: quint8 {
+        BinaryTransmit = 0x01,
+        BinaryResponse = 0x81,
+        BinaryError = 0xFF
+    };
+    void processBinary(const QByteArray &frame);
+    void sendBinary(quint8 opcode, quint8 index, quint32 id, const QByteArray &payload);
 
     // message transport
     QWebSocket *ws = nullptr;
     QLocalSocket *ls = nullptr;
+    FrameReader frames{64 * 1024 * 1024}; // local socket receive buffer
 
     // browser context
-    QString msgid;
+    QSet<QString> requests; // ids in flight
+    QMap<QString, QQueue<QString>> pending; // ids waiting for a reader, in order
+    QString connecting; // id waiting for reader selection
+    QString pki; // id of the PKI operation
+    QString browser; // from web-eid-bridge, empty on the WebSocket
+    bool handshake = true; // the next local socket frame may be internal
+    bool binary = false; // binary frames negotiated
+    bool cbor = false; // CBOR replies negotiated, needs Qt 5.12
+    QStringList indexes; // reader names by index, for binary frames
+    QHash<QString, quint8> binaryRequests; // binary ids in flight => reader index
     QPKI *PKI;
     QtPCSC *PCSC;
 
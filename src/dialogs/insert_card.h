@@ -42,10 +42,10 @@ public:
         activateWindow();
     };
 
-    void cardInserted(const QString &reader, const QByteArray &atr, const QStringList &flags) {
-        _log("Card inserted: %s", qPrintable(atr.toHex()));
+    void cardInserted(const QString &reader, const QPCSCReaderState &state) {
+        _log("Card inserted: %s", qPrintable(state.atr.toHex()));
         if (this->reader->name == reader) {
-            if (flags.contains("MUTE")) {
+            if (state.isMute()) {
                 message->setText(tr("Inserted card can not be used, please check the card"));
             } else {
                 accept();
@@ -163,9 +163,8 @@ public slots:
         raise();
     }
 
-    void cardInserted(const QString &reader, const QByteArray &atr, const QStringList &flags) {
-        (void)atr;
-        if (flags.contains("MUTE")) {
+    void cardInserted(const QString &reader, const QPCSCReaderState &state) {
+        if (state.isMute()) {
             message->setText(tr("Inserted card is not usable. Please check.").arg(reader));
         } else {
             message->setText(tr("Card inserted, looking for certificates ..."));
@@ -124,7 +124,7 @@ public:
     }
 
 public slots:
-    void update(QMap<QString, QPair<QByteArray, QStringList>> readers) {
+    void update(QMap<QString, QPCSCReaderState> readers) {
         _log("Reader list changed");
         message->clear();
         select->clear();
@@ -146,7 +146,7 @@ public slots:
             remember->setChecked(remembered == selected);
             defaultmessage = tr("Allow access to %1?").arg(reader);
             // TODO: call readerChanged() with the current data to set dialog content
-            if (readers[reader].second.contains("EXCLUSIVE")) {
+            if (readers[reader].isExclusive()) {
                 message->setText(tr("%1 can not be used.\nIt is used exclusively by some other application").arg(reader));
                 ok->setEnabled(false);
                 remember->hide();
@@ -175,15 +175,15 @@ public slots:
             // Disable readers
             QStandardItemModel* model = qobject_cast<QStandardItemModel*>(select->model());
             for (const auto &reader: readers.keys()) {
-                _log("Reader %s has %s", qPrintable(reader), qPrintable(readers[reader].second.join(",")));
+                _log("Reader %s has %s", qPrintable(reader), qPrintable(readers[reader].names().join(",")));
                 QStandardItem *item = model->findItems(reader).at(0);
                 // Disable some elements, if necessary
-                if (readers[reader].second.contains("EXCLUSIVE")) {
+                if (readers[reader].isExclusive()) {
                     _log("Disabling combo %s", qPrintable(reader));
                     item->setEnabled(false);
                     item->setToolTip(tr("Reader is in exclusive use by some other application"));
                 } else {
-                    if (!atrs.isEmpty() && atrs.contains(readers[reader].first)) {
+                    if (!atrs.isEmpty() && atrs.contains(readers[reader].atr)) {
                         message->setText(tr("This reader has the expected card"));
                         select->setCurrentText(reader);
                     }
@@ -218,20 +218,19 @@ public slots:
         this->readers = readers;
     }
 
-    void cardInserted(const QString &reader, const QByteArray &atr, const QStringList &flags) {
+    void cardInserted(const QString &reader, const QPCSCReaderState &state) {
         _log("Card inserted: %s", qPrintable(reader));
         // Update our view
-        readers[reader].first = atr;
-        readers[reader].second = flags;
+        readers[reader] = state;
 
         // Disable a reader as needed
         if (select->count() > 1) {
             QStandardItemModel* model = qobject_cast<QStandardItemModel*>(select->model());
             for (const auto &reader: readers.keys()) {
-                _log("Reader %s has %s", qPrintable(reader), qPrintable(readers[reader].second.join(",")));
+                _log("Reader %s has %s", qPrintable(reader), qPrintable(readers[reader].names().join(",")));
                 QStandardItem *item = model->findItems(reader).at(0);
                 // Disable some elements, if necessary
-                if (readers[reader].second.contains("EXCLUSIVE")) {
+                if (readers[reader].isExclusive()) {
                     _log("Disabling combo %s", qPrintable(reader));
                     item->setEnabled(false);
                     item->setToolTip(tr("Reader is in exclusive use by some other application"));
@@ -241,7 +240,7 @@ public slots:
                 }
             }
         } else {
-            if (flags.contains("EXCLUSIVE")) {
+            if (state.isExclusive()) {
                 message->setText(tr("%1 can not be used.\nIt is used exclusively by some other application").arg(reader));
                 ok->setEnabled(false);
                 cancel->setDefault(true);
@@ -259,7 +258,7 @@ public slots:
         selected = reader;
         select->setCurrentText(reader);
         if (!atrs.isEmpty()) {
-            if (atrs.contains(atr)) {
+            if (atrs.contains(state.atr)) {
                 message->setText(tr("Inserted card is the expected card"));
             } else {
                 message->setText(tr("Inserted card is not the expected card"));
@@ -268,17 +267,16 @@ public slots:
             message->setText(defaultmessage);
         }
 
-        if (flags.contains("MUTE")) {
+        if (state.isMute()) {
             message->setText(tr("Inserted card is not working, please check the card."));
         }
     }
 
-    void readerChanged(const QString &reader, const QByteArray &atr, const QStringList &flags) {
+    void readerChanged(const QString &reader, const QPCSCReaderState &state) {
         _log("Reader changed: %s", qPrintable(reader));
 
         // Update our view
-        readers[reader].first = atr;
-        readers[reader].second = flags;
+        readers[reader] = state;
     }
 
 
@@ -286,8 +284,7 @@ public slots:
         _log("Card removed: %s", qPrintable(reader));
 
         // Update our view
-        readers[reader].first.clear();
-        readers[reader].second.clear();
+        readers[reader] = QPCSCReaderState();
 
         // Reset message after a possibly mute message
         message->setText(defaultmessage);
@@ -297,8 +294,8 @@ public slots:
 
         // But override if a usable card with the wanted ATR is present
         for (const auto &r: readers.keys()) {
-            _log("Reader %s has %s", qPrintable(r), qPrintable(readers[r].second.join(",")));
-            if (!atrs.isEmpty() && atrs.contains(readers[r].first) && !readers[r].second.contains("EXCLUSIVE")) {
+            _log("Reader %s has %s", qPrintable(r), qPrintable(readers[r].names().join(",")));
+            if (!atrs.isEmpty() && atrs.contains(readers[r].atr) && !readers[r].isExclusive()) {
                 select->setCurrentText(r);
             }
         }
@@ -330,5 +327,5 @@ private:
     QTimeLine *autoaccept;
     QString oktext;
     QString defaultmessage;
-    QMap<QString, QPair<QByteArray, QStringList>> readers;
+    QMap<QString, QPCSCReaderState> readers;
 };
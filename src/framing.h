@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include <QByteArray>
+#include <QIODevice>
+
+#include <cstring>
+
+/*
+ Length prefixed frames on the local socket, the same as native messaging:
+ u32 length in native byte order, followed by the message.
+
+ The reader keeps what has arrived between readyRead signals, so a frame may
+ arrive in pieces and several frames may arrive at once.
+
+ FrameReader frames(limit);
+ frames.read(socket);
+ QByteArray msg;
+ while (frames.next(msg))
+     handle(msg);
+ if (frames.failed())
+     abort();
+*/
+class FrameReader {
+public:
+    explicit FrameReader(quint32 limit): limit(limit) {}
+
+    void read(QIODevice *device) {
+        buffer.append(device->readAll());
+    }
+
+    // Takes the next complete frame. False when more data is needed or the
+    // stream is broken
+    bool next(QByteArray &frame) {
+        quint32 size = 0;
+        if (!error && buffer.size() - offset >= int(sizeof(size))) {
+            memcpy(&size, buffer.constData() + offset, sizeof(size));
+            if (size > limit) {
+                error = true;
+            } else if (buffer.size() - offset - int(sizeof(size)) >= int(size)) {
+                frame = buffer.mid(offset + int(sizeof(size)), int(size));
+                offset += int(sizeof(size)) + int(size);
+                return true;
+            }
+        }
+        // Drop the consumed frames once per wake-up, not once per frame
+        buffer.remove(0, offset);
+        offset = 0;
+        return false;
+    }
+
+    // A frame was larger than the limit
+    bool failed() const {
+        return error;
+    }
+
+    // Bytes of incomplete frames
+    int pending() const {
+        return buffer.size() - offset;
+    }
+
+private:
+    QByteArray buffer;
+    int offset = 0;
+    quint32 limit;
+    bool error = false;
+};
+
+static inline void writeFrame(QIODevice *device, const QByteArray &msg) {
+    quint32 size = quint32(msg.size());
+    device->write(reinterpret_cast<const char *>(&size), sizeof(size));
+    device->write(msg);
+}
@@ -6,6 +6,8 @@
 
 #include "autostart.h"
 #include "webextension.h"
+#include "qpcscsim.h"
+#include "apdutrace.h"
 
 //#include "util.h"
 #include "debuglog.h"
@@ -28,6 +30,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <string.h>
 #include <iostream>
 
 #ifdef Q_OS_WIN
@@ -62,26 +65,32 @@ QtHost::QtHost(int &argc, char *argv[]) : QApplication(argc, argv), PKI(&this->P
     QCommandLineParser parser;
     QCommandLineOption debug("debug");
     parser.addOption(debug);
+    // Handled in main(), before PC/SC is started
+    QCommandLineOption simulate("simulate", "Use simulated readers from <file>", "file");
+    parser.addOption(simulate);
     parser.process(arguments());
     if (parser.isSet(debug)) {
         once = true;
         settings.setValue("debug", true);
     }
 
+    // Simulated runs leave the session alone
+    bool simulated = QPCSCSimulator::isActive();
+
     // On first run, open a welcome page
-    if (settings.value("firstRun", true).toBool()) {
+    if (!simulated && settings.value("firstRun", true).toBool()) {
         QDesktopServices::openUrl(QUrl(settings.value("welcomeUrl", "https://web-eid.com/welcome").toString()));
         settings.setValue("firstRun", false);
     }
 
     // Enable autostart, if not explicitly disabled
-    if (settings.value("startAtLogin", true).toBool()) {
+    if (!simulated && settings.value("startAtLogin", true).toBool()) {
         // We always overwrite
         StartAtLoginHelper::setEnabled(true);
     }
 
     // Register extension, if not explicitly disabled
-    if (settings.value("registerExtension", true).toBool()) {
+    if (!simulated && settings.value("registerExtension", true).toBool()) {
         WebExtensionHelper::setEnabled(true);
     }
 
@@ -198,6 +207,16 @@ QtHost::QtHost(int &argc, char *argv[]) : QApplication(argc, argv), PKI(&this->P
     connect(viewLog, &QAction::triggered, this, [=] {
         QDesktopServices::openUrl(QUrl::fromLocalFile(Logger::getLogFilePath()));
     });
+    QAction *exportTrace = debugMenu->addAction(tr("Export APDU trace"));
+    connect(exportTrace, &QAction::triggered, this, [=] {
+        // On the desktop, where the user can find it to attach to a report
+        QString path = QDir(QStandardPaths::writableLocation(QStandardPaths::DesktopLocation)).filePath("web-eid-trace.bin");
+        if (APDUTrace::exportTo(path)) {
+            tray.showMessage(tr("APDU trace"), QDir::toNativeSeparators(path));
+        } else {
+            tray.showMessage(tr("APDU trace"), tr("Could not write %1").arg(QDir::toNativeSeparators(path)), QSystemTrayIcon::Warning);
+        }
+    });
 
     softCertEnabled = debugMenu->addAction(tr("Enable softcerts"));
     softCertEnabled->setCheckable(true);
@@ -333,6 +352,10 @@ QtHost::QtHost(int &argc, char *argv[]) : QApplication(argc, argv), PKI(&this->P
 
     qRegisterMetaType<CertificatePurpose>();
     qRegisterMetaType<P11Token>();
+    qRegisterMetaType<QList<APDUStep>>();
+    qRegisterMetaType<QPCSCOptions>();
+    qRegisterMetaType<QPCSCReaderState>();
+    qRegisterMetaType<QMap<QString, QPCSCReaderState>>();
 
     connect(&PKI, &QPKI::certificateListChanged, [=] (QVector<QByteArray> certs) {
         printf("Certificate list changed, contains %d entries\n", certs.size());
@@ -437,5 +460,18 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    // Simulated readers instead of PC/SC, for tests and benchmarks
+    QString simulation = QString::fromLocal8Bit(qgetenv("WEB_EID_SIMULATE"));
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc) {
+            simulation = QString::fromLocal8Bit(argv[i + 1]);
+        } else if (strncmp(argv[i], "--simulate=", 11) == 0) {
+            simulation = QString::fromLocal8Bit(argv[i] + 11);
+        }
+    }
+    if (!simulation.isEmpty() && !QPCSCSimulator::load(simulation)) {
+        exit(1);
+    }
+
     return QtHost(argc, argv).exec();
 }
@@ -3,6 +3,7 @@
  */
 
 #include "../debuglog.h"
+#include "../framing.h"
 
 #include <QCoreApplication>
 #include <QCommandLineParser>
@@ -18,6 +19,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
+#include <string.h>
 #include <iostream>
 
 #ifdef _WIN32
@@ -43,10 +45,11 @@ public:
         while (std::cin.read((char*)&messageLength, sizeof(messageLength))) {
             _log("Message size: %u", messageLength);
             QByteArray msg(int(messageLength), 0);
-            std::cin.read(msg.data(), msg.size());
+            if (!std::cin.read(msg.data(), msg.size()))
+                break;
             _log("Message (%u): %s", messageLength, msg.constData());
-            QVariantMap json = QJsonDocument::fromJson(msg).toVariant().toMap();
-            emit fromBrowser(json);
+            // Passed verbatim, the app parses it
+            emit fromBrowser(msg);
         }
         _log("Input reading thread is done.");
         // If input is closed, we quit
@@ -54,7 +57,7 @@ public:
     }
 
 signals:
-    void fromBrowser(const QVariantMap &msg);
+    void fromBrowser(const QByteArray &msg);
 };
 
 class NMBridge: public QCoreApplication
@@ -76,7 +79,8 @@ public:
         }
 
         // Allow to signal quit from command line
-        if (!args.contains("--quit")) {
+        command = args.contains("--quit");
+        if (!command) {
             browser = "unknown";
             if (args.at(1).startsWith("chrome-extension://")) {
                 browser = "chrome";
@@ -143,8 +147,8 @@ public:
                 _log("QLocalSocket::ServerNotFoundError");
             }
             if ((socketError == QLocalSocket::ConnectionRefusedError) || (socketError == QLocalSocket::ServerNotFoundError)) {
-                if (args.contains("--quit")) {
-                    _log("Quit, do nothing");
+                if (command) {
+                    _log("Not running, do nothing");
                     // Assume it is not running and quit the native agent
                     _exit(1); // FIXME: quit() hangs on all platforms, aboutToQuit is not called
                     return quit();
@@ -205,65 +209,52 @@ public slots:
         server_started = 0; //FIXME: remove
 
         connect(sock, &QLocalSocket::readyRead, [this] {
-            // Data available from app, read message and pass to browser
+            // Data available from app, pass every complete message to browser
             _log("Handling message from application");
             _log("%d bytes available from app", sock->bytesAvailable());
-            quint32 msgsize = 0;
-            if (sock->bytesAvailable() < qint64(sizeof(msgsize) + 1)) {
-                _log("Not enought data available %d, waiting for next update", sock->bytesAvailable());
-                return;
+            frames.read(sock);
+            QByteArray msg;
+            while (frames.next(msg)) {
+                // Pass verbatim from app to browser
+                _log("Response(%d) %s", msg.size(), msg.constData());
+                writeFrame(&out, msg);
             }
-            if (sock->read((char*)&msgsize, sizeof(msgsize)) == sizeof(msgsize)) {
-                if (msgsize > 8 * 1024) {
-                    _log("Bad message size, closing");
-                    sock->abort();
-                    return;
-                }
-                QByteArray msg(int(msgsize), 0);
-                qint64 readsize = sock->read(msg.data(), msgsize) ;
-                if (readsize == msgsize) {
-                    _log("Read message of %d bytes", msgsize);
-                    // Pass verbatim from app to browser
-                    quint32 responseLength = msg.size();
-                    _log("Response(%u) %s", responseLength, msg.constData());
-                    out.write((const char*)&responseLength, sizeof(responseLength));
-                    out.write(msg);
-                    out.flush();
-                } else {
-                    _log("Could not read message, read %d of %d", readsize, msgsize);
-                    sock->abort();
-                }
-            } else {
-                _log("Could not read message size");
-                // TODO: shutdown? close? abort?
+            out.flush();
+            if (frames.failed()) {
+                _log("Bad message size, closing");
                 sock->abort();
+            } else if (frames.pending() > 0) {
+                _log("%d bytes of a message pending, waiting for next update", frames.pending());
             }
         });
 
         // Quit the app
         if (args.contains("--quit")) {
-            toApp({{"internal", "quit"}});
+            internal({{"internal", "quit"}});
             return quit();
         }
 
+        // Tell the app about the browser once, messages are passed as they are
+        internal({{"internal", "browser"}, {"browser", browser}});
+
         // Start input reading thread, if not already running
         if (!input->isRunning()) {
             input->start();
         }
     }
 
-    void toApp(QVariantMap msg) {
+    void toApp(const QByteArray &msg) {
         _log("Handling message from browser");
-        // Enrich with information about browser
-        msg["browser"] = browser;
-        QByteArray json =  QJsonDocument::fromVariant(msg).toJson();
-        quint32 msglen = json.size();
         // TODO: error handling?
-        sock->write((const char*)&msglen, sizeof(msglen));
-        sock->write(json);
+        writeFrame(sock, msg);
         sock->flush();
     }
 
+    // Messages of the bridge itself
+    void internal(const QVariantMap &msg) {
+        toApp(QJsonDocument::fromVariant(msg).toJson(QJsonDocument::Compact));
+    }
+
 private:
     // We have a single connection to the server app
     QLocalSocket *sock;
@@ -272,8 +263,11 @@ private:
     QString serverApp;
     InputChecker *input;
     QFile out;
+    // Browsers accept messages of up to 1MB from the native host
+    FrameReader frames{1024 * 1024};
     QString browser;
     QStringList args;
+    bool command = false; // run from command line
 };
 
 int main(int argc, char *argv[]) {
@@ -3,11 +3,11 @@
  */
 
 #include "qpcsc.h"
+#include "apdutrace.h"
 
 #include "util.h"
 
-#include <set>
-#include <map>
+#include <cstring>
 
 #include <QDialogButtonBox>
 #include <QHeaderView>
@@ -19,6 +19,13 @@
 #include <QJsonDocument>
 #include <QMutexLocker>
 #include <QTime>
+#include <QVector>
+#include <QHash>
+#include <QSet>
+#include <QThreadStorage>
+#include <QTimer>
+#include <QSettings>
+#include <QElapsedTimer>
 
 #include "dialogs/reader_in_use.h"
 #include "dialogs/insert_card.h"
@@ -52,7 +59,58 @@ LONG SCCall(const char *fun, const char *file, int line, const char *function, F
     Logger::writeLog(fun, file, line, "%s: %s (0x%08x)", function, QtPCSC::errorName(err), err);
     return err;
 }
-#define SCard(API, ...) SCCall(__FUNCTION__, __FILE__, __LINE__, "SCard" #API, SCard##API, __VA_ARGS__)
+#define SCard(API, ...) SCCall(__FUNCTION__, __FILE__, __LINE__, "SCard" #API, QPCSCBackend::current().API, __VA_ARGS__)
+
+static QPCSCBackend backend = QPCSCBackend::system();
+
+QPCSCBackend QPCSCBackend::system() {
+    QPCSCBackend b;
+    b.EstablishContext = [] (DWORD scope, LPCVOID reserved1, LPCVOID reserved2, LPSCARDCONTEXT context) -> LONG {
+        return SCardEstablishContext(scope, reserved1, reserved2, context);
+    };
+    b.ReleaseContext = [] (SCARDCONTEXT context) -> LONG {
+        return SCardReleaseContext(context);
+    };
+    b.Cancel = [] (SCARDCONTEXT context) -> LONG {
+        return SCardCancel(context);
+    };
+    b.ListReaders = [] (SCARDCONTEXT context, LPCSTR groups, LPSTR readers, LPDWORD size) -> LONG {
+        return SCardListReaders(context, groups, readers, size);
+    };
+    b.GetStatusChange = [] (SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count) -> LONG {
+        return SCardGetStatusChange(context, timeout, states, count);
+    };
+    b.Connect = [] (SCARDCONTEXT context, LPCSTR reader, DWORD mode, DWORD protocols, LPSCARDHANDLE card, LPDWORD protocol) -> LONG {
+        return SCardConnect(context, reader, mode, protocols, card, protocol);
+    };
+    b.Reconnect = [] (SCARDHANDLE card, DWORD mode, DWORD protocols, DWORD initialization, LPDWORD protocol) -> LONG {
+        return SCardReconnect(card, mode, protocols, initialization, protocol);
+    };
+    b.Disconnect = [] (SCARDHANDLE card, DWORD disposition) -> LONG {
+        return SCardDisconnect(card, disposition);
+    };
+    b.BeginTransaction = [] (SCARDHANDLE card) -> LONG {
+        return SCardBeginTransaction(card);
+    };
+    b.EndTransaction = [] (SCARDHANDLE card, DWORD disposition) -> LONG {
+        return SCardEndTransaction(card, disposition);
+    };
+    b.Status = [] (SCARDHANDLE card, LPSTR names, LPDWORD namesize, LPDWORD state, LPDWORD protocol, LPBYTE atr, LPDWORD atrsize) -> LONG {
+        return SCardStatus(card, names, namesize, state, protocol, atr, atrsize);
+    };
+    b.Transmit = [] (SCARDHANDLE card, const SCARD_IO_REQUEST *sendpci, const BYTE *send, DWORD sendsize, SCARD_IO_REQUEST *recvpci, LPBYTE recv, LPDWORD recvsize) -> LONG {
+        return SCardTransmit(card, sendpci, send, sendsize, recvpci, recv, recvsize);
+    };
+    return b;
+}
+
+const QPCSCBackend &QPCSCBackend::current() {
+    return backend;
+}
+
+void QPCSCBackend::install(const QPCSCBackend &b) {
+    backend = b;
+}
 
 
 // List taken from pcsc-lite source
@@ -121,6 +179,68 @@ static QStringList stateNames(DWORD state) {
     return result;
 }
 
+QStringList QPCSCReaderState::names() const {
+    return stateNames(state);
+}
+
+static quint16 statusWord(const QByteArray &response) {
+    if (response.size() < 2)
+        return 0;
+    return quint16((quint8(response.at(response.size() - 2)) << 8) | quint8(response.at(response.size() - 1)));
+}
+
+static bool parseProtocol(const QString &protocol, DWORD &proto) {
+    if (protocol == "T=0") {
+        proto = SCARD_PROTOCOL_T0;
+    } else if (protocol == "T=1") {
+        proto = SCARD_PROTOCOL_T1;
+    } else if (protocol == "*") {
+        proto = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// What negotiation worked before, shared by all I/O threads: the protocol of
+// an ATR and the readers where an exclusive connection recently failed
+static QMutex negotiationMutex;
+static QHash<QByteArray, DWORD> negotiatedProtocols;
+static QHash<QString, int> sharedReaders; // => connections to try in shared mode first
+static const int SHARED_HINT_CONNECTIONS = 3;
+
+static DWORD cachedProtocol(const QByteArray &atr, DWORD proto) {
+    QMutexLocker locker(&negotiationMutex);
+    DWORD cached = negotiatedProtocols.value(atr, 0);
+    return (cached & proto) ? cached : proto;
+}
+
+static void rememberProtocol(const QByteArray &atr, DWORD proto) {
+    QMutexLocker locker(&negotiationMutex);
+    negotiatedProtocols[atr] = proto;
+}
+
+static void forgetProtocol(const QByteArray &atr) {
+    QMutexLocker locker(&negotiationMutex);
+    negotiatedProtocols.remove(atr);
+}
+
+// Exclusive is tried again after a few connections
+static bool preferShared(const QString &reader) {
+    QMutexLocker locker(&negotiationMutex);
+    auto i = sharedReaders.find(reader);
+    if (i == sharedReaders.end())
+        return false;
+    if (--i.value() <= 0)
+        sharedReaders.erase(i);
+    return true;
+}
+
+static void rememberSharingViolation(const QString &reader) {
+    QMutexLocker locker(&negotiationMutex);
+    sharedReaders[reader] = SHARED_HINT_CONNECTIONS;
+}
+
 static QStringList readerStateNames(DWORD state) {
     QStringList result;
 #define RSTATE(X) if( state & SCARD_##X ) result << #X
@@ -167,13 +287,8 @@ void QPCSCEventWorker::start() {
         _log("Generate returned %s", QtPCSC::errorName(rv));
         // return from generate() means there are no more readers. Clean up
         _log("Doing cleanup");
-        for (auto& k : known.keys()) {
-            if (known[k].second & SCARD_STATE_PRESENT)
-                emit cardRemoved(k);
-            emit readerRemoved(k);
-        }
         known.clear();
-        emit readerListChanged(getReaders());
+        flush();
         emit stopped(rv);
 
         if (rv == LONG(SCARD_E_CANCELLED)) {
@@ -218,16 +333,25 @@ LONG QPCSCEventWorker::generate()
 
     LONG rv = SCARD_S_SUCCESS;
 
+    // Changes are emitted once the burst they start has lasted for the window
+    qint64 window = QSettings().value("eventCoalesceWindow", 200).toInt();
+    QElapsedTimer burst;
+    bool dirty = false;
+    auto changed = [&] {
+        if (!dirty) {
+            burst.start();
+            dirty = true;
+        }
+    };
+
     bool list = true;
-    std::set<std::string> readernames;
     DWORD pnpstate = SCARD_STATE_UNAWARE;
+    std::string readers; // Reused for listing
+    std::vector<SCARD_READERSTATE> statuses; // Reused for every query, rebuilt only after listing
     // Wait for events
     do {
-        std::vector<SCARD_READERSTATE> statuses;
-        bool change = false;
         if (list)  {
             // List readers
-            readernames.clear();
             DWORD size = 0;
             rv = SCard(ListReaders, context, nullptr, nullptr, &size);
             if (rv == LONG(SCARD_E_SERVICE_STOPPED)) {
@@ -242,75 +366,90 @@ LONG QPCSCEventWorker::generate()
                 return rv;
             }
             // TODO: Only meaningful if the size is > 0
-            std::string readers(size, 0);
+            readers.assign(size, 0);
             rv = SCard(ListReaders, context, nullptr, &readers[0], &size);
             if (rv != SCARD_S_SUCCESS && rv != LONG(SCARD_E_NO_READERS_AVAILABLE)) {
                 _log("SCardListReaders: %s", QtPCSC::errorName(rv));
                 continue; // We re-list on next run.
             }
             readers.resize(size);
-            // Extract reader names
-            for (std::string::const_iterator i = readers.begin(); i != readers.end(); ++i) {
-                std::string name(&*i);
-                i += name.size();
-                if (name.empty())
+            // Extract reader names and add new readers
+            std::vector<bool> listed(known.size(), false);
+            for (size_t i = 0; i < readers.size(); i += std::string::traits_type::length(&readers[i]) + 1) {
+                const char *name = &readers[i];
+                if (*name == 0)
+                    continue;
+                _log("Listed %s", name);
+                size_t k = 0;
+                while (k < listed.size() && known[k].name != name)
+                    k++;
+                if (k < listed.size()) {
+                    listed[k] = true;
                     continue;
-                readernames.insert(name);
-                _log("Listed %s", name.c_str());
-            }
-            // Add new readers
-            for (auto &e: readernames) {
-                if (!known.contains(QString::fromStdString(e))) {
-                    QString qe = QString::fromStdString(e);
-                    // New reader detected
-                    mutex.lock();
-                    known[qe].second = SCARD_STATE_UNAWARE;
-                    mutex.unlock();
-                    _log("Emitting attach signal");
-                    emit readerAttached(qe);
-                    change = true;
                 }
+                // New reader detected
+                Reader r;
+                r.name = name;
+                r.qname = QString::fromStdString(r.name);
+                known.push_back(r);
+                changed();
             }
             // Remove unknown readers
-            for (auto &e: known.keys()) {
-                if (!readernames.count(e.toStdString())) {
-                    mutex.lock();
-                    known.remove(e);
-                    mutex.unlock();
-                    _log("Emitting remove signal");
-                    emit readerRemoved(e);
-                    // card removed event was done in previous loop
-                    change = true;
+            for (size_t k = listed.size(); k-- > 0;) {
+                if (!listed[k]) {
+                    known.erase(known.begin() + k);
+                    changed();
                 }
             }
-            // If there is a chance of a reader appearing and another one disappearing
-            // at the same time, we lose events
-            if (change)
-                emit readerListChanged(getReaders());
             // Do not list on next round, unless necessary
             list = false;
+
+            // Construct status query vector, with PnP last, if supported
+            statuses.resize(known.size() + (pnp ? 1 : 0));
+            for (size_t k = 0; k < known.size(); k++) {
+                statuses[k].szReader = known[k].name.c_str();
+                statuses[k].pvUserData = nullptr;
+            }
+            if (pnp) {
+                statuses.back().szReader = pnpReaderName;
+                statuses.back().pvUserData = nullptr;
+            }
         }
 
-        // Construct status query vector
-        statuses.resize(0);
-        for (const auto &r: readernames) {
-            statuses.push_back({r.c_str(), nullptr, known[QString::fromStdString(r)].second, SCARD_STATE_UNAWARE, 0, {0}});
+        // Update current states of the status query
+        for (size_t k = 0; k < known.size(); k++) {
+            statuses[k].dwCurrentState = known[k].state;
+            statuses[k].dwEventState = SCARD_STATE_UNAWARE;
+            statuses[k].cbAtr = 0;
         }
-        // Append PnP, if supported
         if (pnp) {
 #ifdef Q_OS_MAC
             pnpstate = SCARD_STATE_UNAWARE;
 #endif
-            statuses.push_back({pnpReaderName, nullptr, pnpstate, SCARD_STATE_UNAWARE, 0, {0}});
+            statuses.back().dwCurrentState = pnpstate;
+            statuses.back().dwEventState = SCARD_STATE_UNAWARE;
+            statuses.back().cbAtr = 0;
         }
 
         // Debug
-        for (auto &r: statuses) {
-            _log("Querying %s: %s (0x%x)", r.szReader, qPrintable(stateNames(r.dwCurrentState).join(" ")), r.dwCurrentState);
+        if (Logger::isEnabled()) {
+            for (auto &r: statuses) {
+                _log("Querying %s: %s (0x%x)", r.szReader, qPrintable(stateNames(r.dwCurrentState).join(" ")), r.dwCurrentState);
+            }
+        }
+
+        // Emit the net changes of a burst once it has lasted for the window,
+        // until then only wait for the rest of it
+        DWORD timeout = 600000; // FIXME: magic constant
+        if (dirty && burst.elapsed() >= window) {
+            flush();
+            dirty = false;
+        } else if (dirty) {
+            timeout = DWORD(window - burst.elapsed());
         }
 
         // Query statuses
-        rv = SCard(GetStatusChange, context, 600000, &statuses[0], DWORD(statuses.size())); // FIXME: magic constant
+        rv = SCard(GetStatusChange, context, timeout, statuses.data(), DWORD(statuses.size()));
         if (rv == LONG(SCARD_E_UNKNOWN_READER)) {
             // List changed while in air, try again
             list = true;
@@ -321,7 +460,7 @@ LONG QPCSCEventWorker::generate()
             //continue; // SCardListReaders will do the cleanup and emit signals
         }
         if (rv == LONG(SCARD_E_TIMEOUT) || rv == LONG(SCARD_S_SUCCESS)) {
-            // Check if PnP event, always remove from vector
+            // Check if PnP event, always the last one
             if (pnp) {
                 if (statuses.back().dwEventState & SCARD_STATE_CHANGED) {
                     _log("PnP event: %s (0x%x)", qPrintable(stateNames(statuses.back().dwEventState).join(" ")), statuses.back().dwEventState);
@@ -329,59 +468,33 @@ LONG QPCSCEventWorker::generate()
                     pnpstate = statuses.back().dwEventState & ~SCARD_STATE_CHANGED;
                     list = true;
                 }
-                statuses.pop_back();
             }
 
-            // Collect previous statuses for changed readers
-            // And update all changed readers
-            QMap<QString, DWORD> previous;
-            // FIXME: lock for known
-            for (auto &i: statuses) {
-                QString reader(i.szReader);
-                _log("%s: %s (0x%x)", qPrintable(reader), qPrintable(stateNames(i.dwEventState).join(" ")), i.dwEventState);
+            // Update all changed readers, the signals are emitted by flush()
+            for (size_t k = 0; k < known.size(); k++) {
+                const SCARD_READERSTATE &i = statuses[k];
+                Reader &r = known[k];
                 // Did anything change?
                 if (!(i.dwEventState & SCARD_STATE_CHANGED)) {
-                    _log("No change: %s", qPrintable(reader));
                     continue;
-                } else {
-                    // Store previous state for comparison
-                    previous[reader] = known[reader].second;
-                    // Save new state for changed reader, except the changed bit itself. FIXME mutex
-                    known[reader].second = i.dwEventState & ~SCARD_STATE_CHANGED;
                 }
+                if (Logger::isEnabled()) {
+                    _log("%s: %s (0x%x)", r.name.c_str(), qPrintable(stateNames(i.dwEventState).join(" ")), i.dwEventState);
+                }
+                changed();
+                // Save new state for changed reader, except the changed bit itself.
+                r.state = i.dwEventState & ~SCARD_STATE_CHANGED;
+                // A card swapped within the window passes through this
+                if (r.state & SCARD_STATE_EMPTY)
+                    r.emptied = true;
                 // Save ATR, if present
-                QByteArray atr((const char *)i.rgbAtr, i.cbAtr);
-                if (!atr.isEmpty()) {
-                    _log("  atr:%s", atr.toHex().toStdString().c_str());
-                    known[reader].first = atr;
+                if (i.cbAtr > 0 && (r.atr.size() != int(i.cbAtr) || memcmp(r.atr.constData(), i.rgbAtr, i.cbAtr) != 0)) {
+                    r.atr = QByteArray((const char *)i.rgbAtr, int(i.cbAtr));
+                    _log("  atr:%s", r.atr.toHex().constData());
                 }
-            }
-
-            // Emit reader list change before card insertion or removal events
-            if (change) {
-                emit readerListChanged(getReaders());
-            }
-            change = false;
-
-            // Process readers that have a previous state, which means a change in state
-            for (const auto &reader: previous.keys()) {
-                DWORD current = known[reader].second;
-                // Analyze change
-                if (current & SCARD_STATE_UNKNOWN) {
-                    _log("reader removed: %s", qPrintable(reader));
+                if (r.state & SCARD_STATE_UNKNOWN) {
+                    _log("reader removed: %s", r.name.c_str());
                     list = true;
-                    // Emit card removed signal, if card was present
-                    if (previous[reader] & SCARD_STATE_PRESENT) {
-                        emit cardRemoved(reader);
-                    }
-                } else if ((current & SCARD_STATE_PRESENT) && !(previous[reader] & SCARD_STATE_PRESENT)) {
-                    // emit signal about reader list change before card inserted event
-                    emit cardInserted(reader, known[reader].first, stateNames(current));
-                } else if ((current & SCARD_STATE_EMPTY) && (previous[reader] & SCARD_STATE_PRESENT)) {
-                    emit cardRemoved(reader);
-                } else if ((current ^ previous[reader]) & SCARD_STATE_EXCLUSIVE) { // FIXME: compare ATR as well
-                    // if exclusive access changes, trigger UI change
-                    emit readerChanged(reader, known[reader].first, stateNames(current));
                 }
             }
         }
@@ -395,21 +508,81 @@ void QtPCSC::cancel() {
     SCard(Cancel, worker.getContext());
 }
 
-QMap<QString, QPair<QByteArray, QStringList>> QPCSCEventWorker::getReaders() {
-    QMutexLocker locker(&mutex);
-    QMap<QString, QPair<QByteArray, QStringList>> result;
-    for (const auto &e: known.keys()) {
-        result[e].first = known[e].first;
-        result[e].second = stateNames(known[e].second);
+// Emits the net transitions between the last emitted and the current
+// state of the known readers, so that a burst of events results in one
+// signal per reader. The reader list change comes before card events.
+void QPCSCEventWorker::flush() {
+    publish();
+    QMap<QString, QPCSCReaderState> current = getReaders();
+    QSet<QString> emptied;
+    for (auto &r: known) {
+        if (r.emptied)
+            emptied.insert(r.qname);
+        r.emptied = false;
     }
-    return result;
+    bool listed = false;
+    for (auto i = announced.constBegin(); i != announced.constEnd(); ++i) {
+        if (!current.contains(i.key())) {
+            if (i.value().isPresent() && !(i.value().state & SCARD_STATE_UNKNOWN))
+                emit cardRemoved(i.key());
+            _log("Emitting remove signal");
+            emit readerRemoved(i.key());
+            listed = true;
+        }
+    }
+    for (auto i = current.constBegin(); i != current.constEnd(); ++i) {
+        if (!announced.contains(i.key())) {
+            _log("Emitting attach signal");
+            emit readerAttached(i.key());
+            listed = true;
+        }
+    }
+    if (listed) {
+        emit readerListChanged(current);
+    }
+    for (auto i = current.constBegin(); i != current.constEnd(); ++i) {
+        const QPCSCReaderState before = announced.value(i.key());
+        const QPCSCReaderState &now = i.value();
+        // A removed reader has no card
+        bool was = before.isPresent() && !(before.state & SCARD_STATE_UNKNOWN);
+        bool is = now.isPresent() && !(now.state & SCARD_STATE_UNKNOWN);
+        // Replaced within the window, also with a card of the same ATR. The
+        // high word of the state counts card events, where supported, and
+        // covers a swap that happened between two queries
+        bool replaced = was && is && (before.atr != now.atr || emptied.contains(i.key()) || (before.state >> 16) != (now.state >> 16));
+        if (was && (!is || replaced)) {
+            emit cardRemoved(i.key());
+        }
+        if (is && (!was || replaced)) {
+            emit cardInserted(i.key(), now);
+        } else if (was && is && before.isExclusive() != now.isExclusive()) {
+            // if exclusive access changes, trigger UI change
+            emit readerChanged(i.key(), now);
+        }
+    }
+    announced = current;
 }
 
-QMap<QString, QPair<QByteArray, QStringList>> QtPCSC::getReaders() {
+// Called from event thread after every change of the known readers
+void QPCSCEventWorker::publish() {
+    auto next = std::make_shared<QPCSCReaderSnapshot>();
+    for (const auto &r: known) {
+        next->readers[r.qname] = r.current();
+    }
+    std::atomic_store(&snapshot, std::shared_ptr<const QPCSCReaderSnapshot>(next));
+}
+
+// The map is implicitly shared with the snapshot, not copied
+QMap<QString, QPCSCReaderState> QPCSCEventWorker::getReaders() {
+    return std::atomic_load(&snapshot)->readers;
+}
+
+QMap<QString, QPCSCReaderState> QtPCSC::getReaders() {
     return worker.getReaders();
 }
 
-QPCSCReader *QtPCSC::connectReader(WebContext *webcontext, const QString &reader, const QString &protocol, bool wait) {
+
+QPCSCReader *QtPCSC::connectReader(WebContext *webcontext, const QString &reader, const QString &protocol, const QPCSCOptions &options, bool wait) {
     _log("connecting to %s", qPrintable(reader));
     auto rdrs = getReaders();
     // check if empty and show dialog. wired to open, or call open directly
@@ -418,11 +591,11 @@ QPCSCReader *QtPCSC::connectReader(WebContext *webcontext, const QString &reader
         return nullptr;
     }
 
-    QPCSCReader *result = new QPCSCReader(webcontext, this, reader, protocol);
+    QPCSCReader *result = new QPCSCReader(webcontext, this, reader, protocol, options);
 
     connect(this, &QtPCSC::readerRemoved, result, &QPCSCReader::readerRemoved, Qt::QueuedConnection);
 
-    if ((!rdrs[reader].second.contains("PRESENT") || rdrs[reader].second.contains("MUTE")) && wait) {
+    if ((!rdrs[reader].isPresent() || rdrs[reader].isMute()) && wait) {
         _log("Showing insert reader dialog");
         QtInsertCard *dlg = new QtInsertCard(webcontext->friendlyOrigin(), result);
         connect(this, &QtPCSC::cardInserted, dlg, &QtInsertCard::cardInserted, Qt::QueuedConnection);
@@ -437,43 +610,153 @@ QPCSCReader *QtPCSC::connectReader(WebContext *webcontext, const QString &reader
     return result;
 }
 
+// I/O threads
+QPCSCIOThreads::QPCSCIOThreads() {
+}
+
+QPCSCIOThreads::~QPCSCIOThreads() {
+    for (const auto &reader: threads.keys()) {
+        stop(reader);
+    }
+}
+
+QThread *QPCSCIOThreads::threadFor(const QString &reader) {
+    Thread &t = threads[reader];
+    if (!t.thread) {
+        t.thread = new QThread();
+        t.thread->setObjectName(QStringLiteral("PC/SC I/O %1").arg(reader));
+        t.thread->start();
+    }
+    // The name may be taken by another reader after a removal
+    t.removed = false;
+    t.workers++;
+    return t.thread;
+}
+
+void QPCSCIOThreads::release(const QString &reader) {
+    if (!threads.contains(reader)) {
+        return;
+    }
+    Thread &t = threads[reader];
+    if (--t.workers <= 0 && t.removed) {
+        stop(reader);
+    }
+}
+
+// Reader names are not stable, pcsc-lite changes the index on replug
+void QPCSCIOThreads::readerRemoved(const QString &reader) {
+    if (!threads.contains(reader)) {
+        return;
+    }
+    Thread &t = threads[reader];
+    t.removed = true;
+    if (t.workers <= 0) {
+        stop(reader);
+    }
+}
+
+// The thread state, with the warm card and the context, goes with the thread
+void QPCSCIOThreads::stop(const QString &reader) {
+    Thread t = threads.take(reader);
+    t.thread->quit();
+    t.thread->wait();
+    delete t.thread;
+}
+
+QPCSCIOThreads::State::~State() {
+    for (const auto &w: warm) {
+        SCard(Disconnect, w.card, SCARD_RESET_CARD);
+    }
+    // pcsc-lite requirements
+    if (context) {
+        SCard(ReleaseContext, context);
+    }
+}
+
+QPCSCIOThreads::State &QPCSCIOThreads::state() {
+    static QThreadStorage<State *> states;
+    if (!states.hasLocalData()) {
+        states.setLocalData(new State());
+    }
+    return *states.localData();
+}
+
+LONG QPCSCIOThreads::context(SCARDCONTEXT &context, bool fresh) {
+    State &s = state();
+    if (fresh && s.context) {
+        SCard(ReleaseContext, s.context);
+        s.context = 0;
+    }
+    LONG rv = SCARD_S_SUCCESS;
+    if (!s.context) {
+        // Context per thread, required by pcsc-lite
+        rv = SCard(EstablishContext, SCARD_SCOPE_USER, nullptr, nullptr, &s.context);
+        if (rv != SCARD_S_SUCCESS) {
+            s.context = 0;
+        }
+    }
+    context = s.context;
+    return rv;
+}
+
 // Reader
 void QPCSCReader::open() {
-    // Start the thread
-    thread.start();
-    worker.moveToThread(&thread);
+    if (worker) {
+        return;
+    }
+    // Move to the thread that serves this reader
+    worker = new QPCSCReaderWorker();
+    worker->moveToThread(PCSC->readerThread(name));
+    // The thread of a removed reader is stopped after its last worker
+    QtPCSC *pcsc = PCSC;
+    QString reader = name;
+    connect(worker, &QObject::destroyed, pcsc, [pcsc, reader] {
+        pcsc->releaseReaderThread(reader);
+    }, Qt::QueuedConnection);
 
     // control signals
-    connect(this, &QPCSCReader::connectCard, &worker, &QPCSCReaderWorker::connectCard, Qt::QueuedConnection);
-    connect(this, &QPCSCReader::reconnectCard, &worker, &QPCSCReaderWorker::reconnectCard, Qt::QueuedConnection);
-    connect(this, &QPCSCReader::disconnectCard, &worker, &QPCSCReaderWorker::disconnectCard, Qt::QueuedConnection);
-    connect(this, &QPCSCReader::transmitBytes, &worker, &QPCSCReaderWorker::transmit, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::connectCard, worker, &QPCSCReaderWorker::connectCard, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::reconnectCard, worker, &QPCSCReaderWorker::reconnectCard, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::disconnectCard, worker, &QPCSCReaderWorker::disconnectCard, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::transmitBytes, worker, &QPCSCReaderWorker::transmit, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::transmitBatchBytes, worker, &QPCSCReaderWorker::transmitBatch, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::transmitScript, worker, &QPCSCReaderWorker::runScript, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::beginCardTransaction, worker, &QPCSCReaderWorker::beginCardTransaction, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::endCardTransaction, worker, &QPCSCReaderWorker::endCardTransaction, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::abandonCard, worker, &QPCSCReaderWorker::abandon, Qt::QueuedConnection);
+    connect(this, &QPCSCReader::readCardFile, worker, &QPCSCReaderWorker::readFile, Qt::QueuedConnection);
 
     connect(PCSC, &QtPCSC::cardRemoved, this, &QPCSCReader::readerRemoved, Qt::QueuedConnection);
 
     // proxy signals
-    connect(&worker, &QPCSCReaderWorker::disconnected, this, &QPCSCReader::disconnected, Qt::QueuedConnection);
-    connect(&worker, &QPCSCReaderWorker::connected, this, &QPCSCReader::connected, Qt::QueuedConnection);
-    connect(&worker, &QPCSCReaderWorker::reconnected, this, &QPCSCReader::reconnected, Qt::QueuedConnection);
-    connect(&worker, &QPCSCReaderWorker::received, this, &QPCSCReader::received, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::disconnected, this, &QPCSCReader::disconnected, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::connected, this, &QPCSCReader::connected, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::reconnected, this, &QPCSCReader::reconnected, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::received, this, &QPCSCReader::received, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::receivedBatch, this, &QPCSCReader::receivedBatch, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::receivedScript, this, &QPCSCReader::receivedScript, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::fileRead, this, &QPCSCReader::fileRead, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::transactionStarted, this, &QPCSCReader::transactionStarted, Qt::QueuedConnection);
+    connect(worker, &QPCSCReaderWorker::transactionEnded, this, &QPCSCReader::transactionEnded, Qt::QueuedConnection);
 
     // Open the "in use"" dialog.
-    connect(&worker, &QPCSCReaderWorker::connected, this, [=] {
+    connect(worker, &QPCSCReaderWorker::connected, this, [=] {
         isOpen = true;
         WebContext *ctx = static_cast<WebContext *>(parent());
         QtReaderInUse *inusedlg = new QtReaderInUse(ctx->friendlyOrigin(), name);
-        connect(inusedlg, &QDialog::rejected, &worker, &QPCSCReaderWorker::disconnectCard, Qt::QueuedConnection);
+        connect(inusedlg, &QDialog::rejected, worker, &QPCSCReaderWorker::disconnectCard, Qt::QueuedConnection);
         // And close the dialog if reader is disconnected
-        connect(&worker, &QPCSCReaderWorker::disconnected, inusedlg, &QDialog::accept, Qt::QueuedConnection);
+        connect(worker, &QPCSCReaderWorker::disconnected, inusedlg, &QDialog::accept, Qt::QueuedConnection);
         connect(ctx, &WebContext::disconnected, inusedlg, &QDialog::reject);
     }, Qt::QueuedConnection);
 
     // connect in thread
-    emit connectCard(name, protocol);
+    options.atr = PCSC->getReaders().value(name).atr;
+    emit connectCard(name, protocol, options);
 }
 
-void QPCSCReader::cardInserted(const QString &reader, const QByteArray &atr, const QStringList &flags) {
-    if ((this->name == reader) && (!atr.isEmpty()) && !flags.contains("MUTE")) {
+void QPCSCReader::cardInserted(const QString &reader, const QPCSCReaderState &state) {
+    if ((this->name == reader) && (!state.atr.isEmpty()) && !state.isMute()) {
         open();
     }
 }
@@ -497,49 +780,110 @@ void QPCSCReader::transmit(const QByteArray &apdu) {
     emit transmitBytes(apdu);
 }
 
+void QPCSCReader::transmitBatch(const QList<QByteArray> &apdus) {
+    emit transmitBatchBytes(apdus);
+}
+
+void QPCSCReader::runScript(const QList<APDUStep> &script) {
+    emit transmitScript(script);
+}
+
+void QPCSCReader::beginTransaction() {
+    emit beginCardTransaction();
+}
+
+void QPCSCReader::endTransaction() {
+    emit endCardTransaction();
+}
+
+void QPCSCReader::readFile(const QByteArray &path, int chunk) {
+    emit readCardFile(path, chunk);
+}
+
+// Cancels the commands already sent to the worker and
+// releases the card without waiting for them
+void QPCSCReader::abandon() {
+    options.cancel.cancel();
+    if (worker) {
+        emit abandonCard();
+    }
+}
+
 void QPCSCReader::reconnect(const QString &protocol) {
     emit reconnectCard(protocol);
 }
 
 // Worker
 QPCSCReaderWorker::~QPCSCReaderWorker() {
-    if (card) {
+    if (card && !leaveChannel()) {
         SCard(Disconnect, card, SCARD_LEAVE_CARD);
     }
-    // pcsc-lite requirements
-    if (context) {
-        SCard(ReleaseContext, context);
-    }
+    unschedule();
+    releaseTransaction();
+    // The context is kept by the thread
 }
 
-void QPCSCReaderWorker::connectCard(const QString &reader, const QString &protocol) {
+void QPCSCReaderWorker::connectCard(const QString &reader, const QString &protocol, const QPCSCOptions &options) {
     name = reader;
-    LONG rv = SCARD_S_SUCCESS;
-    // Context per thread, required by pcsc-lite
-    rv = SCard(EstablishContext, SCARD_SCOPE_USER, nullptr, nullptr, &context);
+    this->options = options;
+    LONG rv = QPCSCIOThreads::context(context);
     if (rv != SCARD_S_SUCCESS) {
         return emit disconnected(rv);
     }
 
-    // protocol
-    DWORD proto = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
-    if (protocol == "T=0") {
-        proto = SCARD_PROTOCOL_T0;
-    } else if (protocol == "T=1") {
-        proto = SCARD_PROTOCOL_T1;
-    } else if (protocol == "*") {
-        // do nothing, default
-    } else {
+    // protocol, preferring the one that worked for the card before
+    DWORD requested = 0;
+    if (!parseProtocol(protocol, requested)) {
         return emit disconnected(SCARD_E_INVALID_PARAMETER);
     }
+    DWORD proto = cachedProtocol(options.atr, requested);
+
+    // Open a logical channel on the card of another connection
+    if (openChannel()) {
+        _log("Connected to %s on logical channel %d", qPrintable(reader), channel);
+        return ready();
+    }
+
+    // Reuse the card kept connected by a previous connection
+    if (adoptCard(proto)) {
+        _log("Connected to warm card in %s in %s mode, protocol %s", qPrintable(reader), mode == SCARD_SHARE_EXCLUSIVE ? "exclusive" : "shared", this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+        return ready();
+    }
+
+#ifndef Q_OS_WIN
+    // Without the implicit transaction the card is shared with other connections
+    if (!options.implicitTransaction) {
+        mode = SCARD_SHARE_SHARED;
+    }
+    // Skip the exclusive attempt if it is likely to fail
+    if (mode == SCARD_SHARE_EXCLUSIVE && preferShared(reader)) {
+        _log("Recent sharing violations in %s, connecting in shared mode", qPrintable(reader));
+        mode = SCARD_SHARE_SHARED;
+    }
+#endif
 
     // Try to connect multiple times, a freshly inserted card is often probed by other software as well
-    rv = SCard(Connect, context, reader.toLatin1().data(), mode, proto, &card, &this->protocol);
+    rv = SCard(Connect, context, reader.toUtf8().data(), mode, proto, &card, &this->protocol);
+    if (rv == LONG(SCARD_E_PROTO_MISMATCH) && proto != requested) {
+        // The card has changed behind the same ATR
+        forgetProtocol(options.atr);
+        proto = requested;
+        rv = SCard(Connect, context, reader.toUtf8().data(), mode, proto, &card, &this->protocol);
+    }
+    if (rv == LONG(SCARD_E_INVALID_HANDLE) || rv == LONG(SCARD_E_NO_SERVICE) || rv == LONG(SCARD_E_SERVICE_STOPPED)) {
+        // The kept context has gone stale, eg the service was restarted
+        rv = QPCSCIOThreads::context(context, true);
+        if (rv != SCARD_S_SUCCESS) {
+            return emit disconnected(rv);
+        }
+        rv = SCard(Connect, context, reader.toUtf8().data(), mode, proto, &card, &this->protocol);
+    }
     if (rv == LONG(SCARD_E_SHARING_VIOLATION)) {
 #ifndef Q_OS_WIN
         // On Unix, we are happy with a shared connection + transaction
+        rememberSharingViolation(reader);
         mode = SCARD_SHARE_SHARED;
-        rv = SCard(Connect, context, reader.toLatin1().data(), mode, proto, &card, &this->protocol);
+        rv = SCard(Connect, context, reader.toUtf8().data(), mode, proto, &card, &this->protocol);
 #else
         // On Windows we need to have a exclusive connection to defeat the 5sec rule
         // Try several times before giving up
@@ -552,7 +896,7 @@ void QPCSCReaderWorker::connectCard(const QString &reader, const QString &protoc
             QThread::currentThread()->msleep(ms);
             _log("Slept %d", a.msecsTo(QTime::currentTime()));
             i++;
-            rv = SCard(Connect, context, reader.toLatin1().data(), mode, proto, &card, &this->protocol);
+            rv = SCard(Connect, context, reader.toUtf8().data(), mode, proto, &card, &this->protocol);
         } while ((i < 10) && (rv == LONG(SCARD_E_SHARING_VIOLATION)));
 #endif
     }
@@ -563,11 +907,11 @@ void QPCSCReaderWorker::connectCard(const QString &reader, const QString &protoc
     }
 
     // Get fresh information
-    QByteArray tmpname(reader.toLatin1().size() + 2, 0); // XXX: Windows requires 2, for the extra \0 ?
+    QByteArray tmpname(reader.toUtf8().size() + 2, 0); // XXX: Windows requires 2, for the extra \0 ?
     DWORD tmplen = tmpname.size();
     DWORD tmpstate = 0;
     DWORD tmpproto = 0;
-    QByteArray atr(33, 0);
+    atr.resize(33);
     DWORD atrlen = atr.size();
     rv = SCard(Status, card, tmpname.data(), &tmplen, &tmpstate, &tmpproto, (unsigned char *) atr.data(), &atrlen);
     if (rv != SCARD_S_SUCCESS) {
@@ -576,61 +920,489 @@ void QPCSCReaderWorker::connectCard(const QString &reader, const QString &protoc
     atr.resize(atrlen);
     tmpname.resize(tmplen);
     _log("Current state of %s: %s, protocol %d, atr %s", tmpname.data(), qPrintable(readerStateNames(tmpstate).join(",")), tmpproto, qPrintable(atr.toHex()));
+    rememberProtocol(atr, this->protocol);
+
+    _log("Connected to %s in %s mode, protocol %s", qPrintable(reader), mode == SCARD_SHARE_EXCLUSIVE ? "exclusive" : "shared", this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+    ready();
+}
+
+// Commands are queued per connection and run in turns with the other
+// connections to the same reader in this thread
+void QPCSCReaderWorker::schedule(std::function<void()> command) {
+    if (options.cancel.isCancelled()) {
+        return;
+    }
+    auto &state = QPCSCIOThreads::state();
+    auto &s = state.schedulers[name];
+    if (!s.turns.contains(this)) {
+        s.turns.append(this);
+    }
+    auto &q = s.queues[this];
+    q.commands.enqueue(qMakePair(APDUTrace::now(), command));
+    q.maxDepth = qMax(q.maxDepth, q.commands.size());
+    s.maxDepth = qMax(s.maxDepth, ++s.depth);
+    if (!s.posted) {
+        // After the commands already posted to the thread, so that they could take their turn
+        s.posted = true;
+        QString reader = name;
+        QTimer::singleShot(0, &state.dispatcher, [reader] {
+            runScheduled(reader);
+        });
+    }
+}
+
+void QPCSCReaderWorker::runScheduled(const QString &reader) {
+    auto &state = QPCSCIOThreads::state();
+    if (!state.schedulers.contains(reader)) {
+        return;
+    }
+    auto &s = state.schedulers[reader];
+    s.posted = false;
+    // The first one in turn with something to do
+    for (int i = 0; i < s.turns.size() && s.queues[s.turns.first()].commands.isEmpty(); i++) {
+        s.turns.append(s.turns.takeFirst());
+    }
+    if (s.depth == 0 || s.turns.isEmpty()) {
+        return;
+    }
+    QPCSCReaderWorker *worker = s.turns.takeFirst();
+    s.turns.append(worker);
+    auto &q = s.queues[worker];
+    auto command = q.commands.dequeue();
+    s.depth--;
+    qint64 wait = APDUTrace::now() - command.first;
+    q.served++;
+    q.waited += wait;
+    q.maxWait = qMax(q.maxWait, wait);
+
+    if (worker->options.cancel.isCancelled()) {
+        worker->abandon();
+    } else {
+        worker->dispatched = true;
+        command.second();
+        worker->dispatched = false;
+    }
+
+    // The command may have ended the connection
+    if (state.schedulers.contains(reader)) {
+        auto &next = state.schedulers[reader];
+        if (next.depth > 0 && !next.posted) {
+            next.posted = true;
+            QTimer::singleShot(0, &state.dispatcher, [reader] {
+                runScheduled(reader);
+            });
+        }
+    }
+}
+
+// Drops the queued commands of the connection, logging its statistics
+void QPCSCReaderWorker::unschedule() {
+    auto &state = QPCSCIOThreads::state();
+    if (!state.schedulers.contains(name)) {
+        return;
+    }
+    auto &s = state.schedulers[name];
+    if (s.queues.contains(this)) {
+        QPCSCIOThreads::State::Queue q = s.queues.take(this);
+        s.depth -= q.commands.size();
+        s.turns.removeAll(this);
+        if (q.served > 0) {
+            _log("Scheduled %llu commands on %s, wait avg %.2fms max %.2fms, depth max %d of %d on reader", q.served, qPrintable(name),
+                 q.waited / 1e6 / q.served, q.maxWait / 1e6, q.maxDepth, s.maxDepth);
+        }
+    }
+    if (s.turns.isEmpty()) {
+        state.schedulers.remove(name);
+    }
+}
+
+// Drop the queued commands and release the card right away. Reset,
+// so that the next user of the reader would not inherit the card state
+void QPCSCReaderWorker::abandon() {
+    if (abandoned) {
+        return;
+    }
+    abandoned = true;
+    _log("Abandoned connection to %s", qPrintable(name));
+    unschedule();
+    deferred.clear();
+    options.keepWarm = 0;
+    dispatched = true;
+    disconnectCard();
+    dispatched = false;
+}
+
+// Connected, take the implicit transaction or tell right away
+void QPCSCReaderWorker::ready() {
+    // Let the next connections open logical channels on this card
+    auto &state = QPCSCIOThreads::state();
+    if (options.logicalChannels && !state.channelCards.contains(name)) {
+        QPCSCIOThreads::State::ChannelCard &shared = state.channelCards[name];
+        shared.card = card;
+        shared.protocol = protocol;
+        shared.mode = mode;
+        shared.atr = atr;
+        shared.users.append(this);
+    }
+    if (options.implicitTransaction) {
+        return beginTransaction();
+    }
+    announced = true;
+    emit connected(atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+}
+
+// MANAGE CHANNEL on the card shared by another connection. A transaction
+// is held on the shared handle for all of its connections that are in it
+bool QPCSCReaderWorker::openChannel() {
+    auto &state = QPCSCIOThreads::state();
+    if (!options.logicalChannels || !state.channelCards.contains(name)) {
+        return false;
+    }
+    QPCSCIOThreads::State::ChannelCard &shared = state.channelCards[name];
+    card = shared.card;
+    protocol = shared.protocol;
+    mode = shared.mode;
+    atr = shared.atr;
+    if (!manageChannel()) {
+        card = 0;
+        return false;
+    }
+    shared.users.append(this);
+    return true;
+}
+
+// MANAGE CHANNEL, closing the current logical channel first if there is one.
+// Staying on the shared card, a new channel is the reset of this connection
+bool QPCSCReaderWorker::manageChannel() {
+    QByteArray response;
+    if (channel > 0) {
+        QByteArray close = QByteArray::fromHex("00708000");
+        close[3] = char(channel);
+        transmitRaw(close, response);
+        channel = 0;
+    }
+    LONG rv = transmitRaw(QByteArray::fromHex("0070000001"), response);
+    if (rv != SCARD_S_SUCCESS || response.size() != 3 || statusWord(response) != 0x9000 || quint8(response.at(0)) == 0 || quint8(response.at(0)) > 19) {
+        _log("Could not open a logical channel on %s: %s %s", qPrintable(name), QtPCSC::errorName(rv), qPrintable(response.toHex()));
+        return false;
+    }
+    channel = quint8(response.at(0));
+    return true;
+}
 
+// Closes the logical channel. Returns true if the card is still used by
+// other connections, in which case the handle is not disconnected
+bool QPCSCReaderWorker::leaveChannel() {
+    auto &state = QPCSCIOThreads::state();
+    if (!state.channelCards.contains(name) || !state.channelCards[name].users.contains(this)) {
+        return false;
+    }
+    QPCSCIOThreads::State::ChannelCard &shared = state.channelCards[name];
+    shared.users.removeAll(this);
+    shared.transacted.removeAll(this);
+    if (channel > 0) {
+        QByteArray response;
+        QByteArray close = QByteArray::fromHex("00708000");
+        close[3] = char(channel);
+        transmitRaw(close, response);
+        channel = 0;
+    }
+    if (shared.users.isEmpty()) {
+        state.channelCards.remove(name);
+        return false;
+    }
 #ifndef Q_OS_WIN
-    // Transactions on non-windows machines
-    rv = SCard(BeginTransaction, card);
-    if (rv != SCARD_S_SUCCESS) {
-        return emit disconnected(rv);
+    if (state.holders.value(name) == this) {
+        if (!shared.transacted.isEmpty()) {
+            // The others keep the transaction on the handle
+            state.holders[name] = shared.transacted.first();
+        } else {
+            SCard(EndTransaction, card, SCARD_LEAVE_CARD);
+        }
     }
 #endif
+    card = 0;
+    return true;
+}
 
-    _log("Connected to %s in %s mode, protocol %s", qPrintable(reader), mode == SCARD_SHARE_EXCLUSIVE ? "exclusive" : "shared", this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
-    emit connected(atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+// The card shared on logical channels, if this connection is on it
+QPCSCIOThreads::State::ChannelCard *QPCSCReaderWorker::channelCard() {
+    auto &state = QPCSCIOThreads::state();
+    auto i = state.channelCards.find(name);
+    if (i == state.channelCards.end() || !i.value().users.contains(this)) {
+        return nullptr;
+    }
+    return &i.value();
+}
+
+// Transactions on non-windows machines. Another connection of this thread holding the transaction
+// of the same reader would block the whole thread, so wait in line for it instead
+void QPCSCReaderWorker::beginTransaction() {
+#ifndef Q_OS_WIN
+    auto &state = QPCSCIOThreads::state();
+    QPCSCIOThreads::State::ChannelCard *shared = channelCard();
+    QPCSCReaderWorker *holder = state.holders.value(name);
+    // Held on the handle shared with this connection, join it
+    bool joined = holder && shared && shared->transacted.contains(holder);
+    if (holder && holder != this && !joined) {
+        _log("Waiting for transaction on %s", qPrintable(name));
+        state.waiting[name].append(this);
+        return;
+    }
+    if (!holder) {
+        LONG rv = SCard(BeginTransaction, card);
+        if (rv != SCARD_S_SUCCESS && !announced) {
+            return emit disconnected(rv);
+        } else if (rv != SCARD_S_SUCCESS) {
+            emit transactionStarted(rv);
+            return runDeferred();
+        }
+        state.holders[name] = this;
+    }
+    if (shared && !shared->transacted.contains(this)) {
+        shared->transacted.append(this);
+    }
+#endif
+    if (!announced) {
+        announced = true;
+        emit connected(atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+    } else {
+        emit transactionStarted(SCARD_S_SUCCESS);
+    }
+    runDeferred();
+}
+
+bool QPCSCReaderWorker::isWaiting() {
+#ifndef Q_OS_WIN
+    return QPCSCIOThreads::state().waiting.value(name).contains(this);
+#else
+    return false;
+#endif
+}
+
+// Stop waiting in line. The pending begin is answered first,
+// then the commands that arrived behind it run without the transaction
+bool QPCSCReaderWorker::cancelWait() {
+    if (!isWaiting()) {
+        return false;
+    }
+    QPCSCIOThreads::state().waiting[name].removeAll(this);
+    if (announced) {
+        emit transactionStarted(SCARD_E_CANCELLED);
+    }
+    runDeferred();
+    return true;
+}
+
+// Deferred commands were taken from the scheduler already, so they run in
+// place even when another connection releases the transaction. Scheduling
+// them again would put them behind the commands queued meanwhile
+void QPCSCReaderWorker::runDeferred() {
+    bool wasDispatched = dispatched;
+    dispatched = true;
+    while (!deferred.isEmpty() && !isWaiting()) {
+        deferred.takeFirst()();
+    }
+    dispatched = wasDispatched;
+}
+
+void QPCSCReaderWorker::beginCardTransaction() {
+    if (!dispatched) {
+        return schedule([this] { beginCardTransaction(); });
+    }
+    if (isWaiting()) {
+        return deferred.append([this] { beginCardTransaction(); });
+    }
+    beginTransaction();
+}
+
+void QPCSCReaderWorker::endCardTransaction() {
+    if (!dispatched) {
+        return schedule([this] { endCardTransaction(); });
+    }
+    if (cancelWait()) {
+        return emit transactionEnded(SCARD_E_NOT_TRANSACTED);
+    }
+#ifndef Q_OS_WIN
+    auto &state = QPCSCIOThreads::state();
+    // Ended on the shared handle only when the last one in it leaves
+    QPCSCIOThreads::State::ChannelCard *shared = channelCard();
+    if (shared && shared->transacted.removeAll(this) > 0 && !shared->transacted.isEmpty()) {
+        if (state.holders.value(name) == this) {
+            state.holders[name] = shared->transacted.first();
+        }
+        return emit transactionEnded(SCARD_S_SUCCESS);
+    }
+    if (state.holders.value(name) != this) {
+        return emit transactionEnded(SCARD_E_NOT_TRANSACTED);
+    }
+    LONG rv = SCard(EndTransaction, card, SCARD_LEAVE_CARD);
+    releaseTransaction();
+    emit transactionEnded(rv);
+#else
+    // No transactions on Windows due to the "5 second rule"
+    emit transactionEnded(SCARD_S_SUCCESS);
+#endif
+}
+
+// Let the next connection waiting in this thread take the transaction
+void QPCSCReaderWorker::releaseTransaction() {
+#ifndef Q_OS_WIN
+    if (name.isEmpty()) {
+        return;
+    }
+    auto &state = QPCSCIOThreads::state();
+    if (state.waiting.contains(name)) {
+        state.waiting[name].removeAll(this);
+    }
+    if (state.holders.value(name) != this) {
+        return;
+    }
+    state.holders.remove(name);
+    if (state.waiting.contains(name) && !state.waiting[name].isEmpty()) {
+        state.waiting[name].takeFirst()->beginTransaction();
+    }
+#endif
 }
 
 void QPCSCReaderWorker::disconnectCard() {
+    if (!dispatched) {
+        return schedule([this] { disconnectCard(); });
+    }
     LONG rv = SCARD_S_SUCCESS;
-    if (card) {
+    cancelWait();
+    if (card && !leaveChannel()) {
 #ifndef Q_OS_WIN
         // No transactions on Windows due to the "5 second rule"
-        SCard(EndTransaction, card, SCARD_LEAVE_CARD);
+        if (QPCSCIOThreads::state().holders.value(name) == this) {
+            SCard(EndTransaction, card, SCARD_LEAVE_CARD);
+        }
 #endif
-        rv = SCard(Disconnect, card, SCARD_RESET_CARD);
+        if (!parkCard()) {
+            rv = SCard(Disconnect, card, SCARD_RESET_CARD);
+        }
         card = 0;
     }
+    releaseTransaction();
+    unschedule();
     emit disconnected(rv);
 }
 
+// Keep the card connected for a while after disconnect, so that the
+// next connection to the reader would not need a cold reset and ATR
+bool QPCSCReaderWorker::parkCard() {
+    if (options.keepWarm <= 0) {
+        return false;
+    }
+    // Shared, so that the reader would not appear to be exclusively used meanwhile
+    DWORD proto = protocol;
+    LONG rv = SCard(Reconnect, card, SCARD_SHARE_SHARED, protocol, SCARD_LEAVE_CARD, &proto);
+    if (rv != SCARD_S_SUCCESS) {
+        return false;
+    }
+    auto &state = QPCSCIOThreads::state();
+    if (state.warm.contains(name)) {
+        SCard(Disconnect, state.warm.take(name).card, SCARD_RESET_CARD);
+    }
+    QPCSCIOThreads::WarmCard &warm = state.warm[name];
+    warm.card = card;
+    warm.protocol = proto;
+    warm.atr = atr;
+    warm.origin = options.origin;
+    warm.serial = ++state.serial;
+    // Runs in this thread
+    QString reader = name;
+    quint64 serial = warm.serial;
+    QTimer::singleShot(options.keepWarm * 1000, [reader, serial] {
+        auto &state = QPCSCIOThreads::state();
+        if (state.warm.contains(reader) && state.warm.value(reader).serial == serial) {
+            _log("Releasing warm card in %s", qPrintable(reader));
+            SCard(Disconnect, state.warm.take(reader).card, SCARD_RESET_CARD);
+        }
+    });
+    _log("Keeping card in %s warm for %d seconds", qPrintable(name), options.keepWarm);
+    return true;
+}
+
+// Take over a card kept connected by a previous connection, if it is the same
+// card and was not reset meanwhile. Other origins get it only after a reset
+bool QPCSCReaderWorker::adoptCard(DWORD proto) {
+    auto &state = QPCSCIOThreads::state();
+    if (!state.warm.contains(name)) {
+        return false;
+    }
+    QPCSCIOThreads::WarmCard warm = state.warm.take(name);
+    QByteArray tmpname(name.toUtf8().size() + 2, 0); // XXX: Windows requires 2, for the extra \0 ?
+    DWORD tmplen = tmpname.size();
+    DWORD tmpstate = 0;
+    DWORD tmpproto = 0;
+    atr.resize(33);
+    DWORD atrlen = atr.size();
+    LONG rv = SCard(Status, warm.card, tmpname.data(), &tmplen, &tmpstate, &tmpproto, (unsigned char *) atr.data(), &atrlen);
+    atr.resize(rv == SCARD_S_SUCCESS ? atrlen : 0);
+    if (rv != SCARD_S_SUCCESS || atr != warm.atr || !(proto & warm.protocol)) {
+        SCard(Disconnect, warm.card, SCARD_RESET_CARD);
+        return false;
+    }
+    DWORD init = warm.origin == options.origin ? SCARD_LEAVE_CARD : SCARD_RESET_CARD;
+    rv = SCard(Reconnect, warm.card, mode, proto, init, &this->protocol);
+#ifndef Q_OS_WIN
+    if (rv == LONG(SCARD_E_SHARING_VIOLATION)) {
+        mode = SCARD_SHARE_SHARED;
+        rv = SCard(Reconnect, warm.card, mode, proto, init, &this->protocol);
+    }
+#endif
+    if (rv != SCARD_S_SUCCESS) {
+        SCard(Disconnect, warm.card, SCARD_RESET_CARD);
+        return false;
+    }
+    card = warm.card;
+    return true;
+}
+
 void QPCSCReaderWorker::reconnectCard(const QString &protocol) {
+    if (!dispatched) {
+        return schedule([this, protocol] { reconnectCard(protocol); });
+    }
+    if (isWaiting()) {
+        return deferred.append([this, protocol] { reconnectCard(protocol); });
+    }
     LONG rv = SCARD_S_SUCCESS;
-    DWORD proto = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
-    if (protocol == "T=0") {
-        proto = SCARD_PROTOCOL_T0;
-    } else if (protocol == "T=1") {
-        proto = SCARD_PROTOCOL_T1;
-    } else if (protocol == "*") {
-        // do nothing, default
-    } else {
+    DWORD proto = 0;
+    if (!parseProtocol(protocol, proto)) {
         return emit disconnected(SCARD_E_INVALID_PARAMETER);
     }
+    proto = cachedProtocol(atr, proto);
+    // A reset would close the channels of the other connections, so
+    // only the logical channel of this one is opened again, in the
+    // transaction it was in
+    auto &state = QPCSCIOThreads::state();
+    if (state.channelCards.contains(name) && state.channelCards[name].users.size() > 1) {
+        if (channel > 0 && !manageChannel()) {
+            return emit disconnected(SCARD_E_SHARING_VIOLATION);
+        }
+        return emit reconnected(atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
+    }
     // XXX: what to signal and what to do on error ? Needs thinking
     rv = SCard(Reconnect, card, mode, proto, SCARD_RESET_CARD, &this->protocol);
     if (rv != SCARD_S_SUCCESS) {
         return emit disconnected(rv);
     }
 #ifndef Q_OS_WIN
-    rv = SCard(BeginTransaction, card);
-    if (rv != SCARD_S_SUCCESS) {
-        return emit disconnected(rv);
+    // Connections waiting in line get the transaction when it is their turn
+    if (QPCSCIOThreads::state().holders.value(name) == this) {
+        rv = SCard(BeginTransaction, card);
+        if (rv != SCARD_S_SUCCESS) {
+            return emit disconnected(rv);
+        }
     }
 #endif
     // Get fresh information
-    QByteArray tmpname(name.toLatin1().size() + 2, 0); // XXX: Windows requires 2, for the extra \0 ?
+    QByteArray tmpname(name.toUtf8().size() + 2, 0); // XXX: Windows requires 2, for the extra \0 ?
     DWORD tmplen = tmpname.size();
     DWORD tmpstate = 0;
     DWORD tmpproto = 0;
-    QByteArray atr(33, 0);
+    atr.resize(33);
     DWORD atrlen = atr.size();
     rv = SCard(Status, card, tmpname.data(), &tmplen, &tmpstate, &tmpproto, (unsigned char *) atr.data(), &atrlen);
     if (rv != SCARD_S_SUCCESS) {
@@ -639,26 +1411,308 @@ void QPCSCReaderWorker::reconnectCard(const QString &protocol) {
     atr.resize(atrlen);
     tmpname.resize(tmplen);
     _log("Current state of %s: %s, protocol %d, atr %s", tmpname.data(), qPrintable(readerStateNames(tmpstate).join(",")), tmpproto, qPrintable(atr.toHex()));
+    rememberProtocol(atr, this->protocol);
+    if (state.channelCards.contains(name)) {
+        state.channelCards[name].protocol = this->protocol;
+        state.channelCards[name].atr = atr;
+    }
 
     return emit reconnected(atr, this->protocol == SCARD_PROTOCOL_T0 ? "T=0" : "T=1");
 }
 
 
-void QPCSCReaderWorker::transmit(const QByteArray &apdu) {
+// Extended length response with status word
+static const int MAX_RESPONSE_SIZE = 65536 + 2;
+
+// Sets the logical channel in the class byte of an inter-industry command,
+// in the first or further inter-industry form of ISO 7816-4. The first form
+// keeps its secure messaging bits, the further form has only one of them
+static QByteArray onChannel(const QByteArray &apdu, int channel) {
+    if (channel == 0 || apdu.isEmpty()) {
+        return apdu;
+    }
+    quint8 cla = quint8(apdu.at(0));
+    quint8 chaining = cla & 0x10;
+    bool further = cla & 0x40;
+    QByteArray result = apdu;
+    if (channel < 4) {
+        quint8 sm = further ? ((cla & 0x20) ? 0x08 : 0x00) : (cla & 0x0C);
+        result[0] = char(chaining | sm | channel);
+    } else {
+        bool sm = further ? (cla & 0x20) : (cla & 0x0C);
+        result[0] = char(0x40 | (sm ? 0x20 : 0x00) | chaining | (channel - 4));
+    }
+    return result;
+}
+
+// Send a single APDU to the card
+LONG QPCSCReaderWorker::transmitRaw(const QByteArray &command, QByteArray &response) {
+    // A proprietary class has no channel bits, it would reach the basic channel
+    if (channel > 0 && !command.isEmpty() && (quint8(command.at(0)) & 0x80)) {
+        _log("Proprietary class %02x on logical channel %d of %s", quint8(command.at(0)), channel, qPrintable(name));
+        response.clear();
+        return SCARD_E_INVALID_PARAMETER;
+    }
+    const QByteArray apdu = onChannel(command, channel);
     SCARD_IO_REQUEST req;
-    QByteArray response(4096, 0); // Should be enough
+    QByteArray &buffer = QPCSCIOThreads::state().buffer;
+    if (buffer.size() != MAX_RESPONSE_SIZE)
+        buffer.resize(MAX_RESPONSE_SIZE); // Once per thread, so per reader
     req.dwProtocol = protocol;
     req.cbPciLength = sizeof(req);
-    DWORD rlen = response.size();
-    _log("SEND %s", qPrintable(apdu.toHex()));
-    LONG err = SCard(Transmit, card, &req, (const unsigned char *)apdu.data(), DWORD(apdu.size()), &req, (unsigned char *)response.data(), &rlen);
+    DWORD rlen = buffer.size();
+    // Hex is only made if it is going to be written
+    bool logging = Logger::isEnabled();
+    if (logging)
+        _log("SEND %s", qPrintable(apdu.toHex()));
+    qint64 start = APDUTrace::now();
+    LONG err = SCard(Transmit, card, &req, (const unsigned char *)apdu.data(), DWORD(apdu.size()), &req, (unsigned char *)buffer.data(), &rlen);
     if (err != SCARD_S_SUCCESS) {
-        response.resize(0);
+        response.clear();
+        APDUTrace::record(name, start, apdu, response, err);
+        return err;
+    }
+    // Right sized copy, the buffer stays with the thread
+    response = QByteArray(buffer.constData(), int(rlen));
+    APDUTrace::record(name, start, apdu, response, err);
+    if (logging)
+        _log("RECV %s", qPrintable(response.toHex()));
+    return err;
+}
+
+// Send an APDU and, if asked for, follow 6Cxx (wrong Le) and 61xx (more data) responses
+LONG QPCSCReaderWorker::transceive(const QByteArray &apdu, QByteArray &response, bool follow) {
+    // Between the APDU-s of batches and scripts
+    if (options.cancel.isCancelled()) {
+        return SCARD_E_CANCELLED;
+    }
+    LONG err = transmitRaw(apdu, response);
+    if (err != SCARD_S_SUCCESS || !(options.autoResponse || follow) || apdu.size() < 5) {
+        return err;
+    }
+    quint16 sw = statusWord(response);
+    // Re-send with the correct Le, if the command has a short Le (case 2 or 4)
+    if ((sw & 0xFF00) == 0x6C00 && (apdu.size() == 5 || (quint8(apdu.at(4)) != 0 && apdu.size() == 6 + quint8(apdu.at(4))))) {
+        QByteArray corrected = apdu;
+        corrected[corrected.size() - 1] = char(sw & 0xFF);
+        err = transmitRaw(corrected, response);
+        if (err != SCARD_S_SUCCESS) {
+            return err;
+        }
+        sw = statusWord(response);
+    }
+    // Collect the rest of the data with GET RESPONSE on the same logical channel
+    if ((sw & 0xFF00) == 0x6100) {
+        QByteArray data = response.left(response.size() - 2);
+        const char cla = char(quint8(apdu.at(0)) & ((quint8(apdu.at(0)) & 0x40) ? 0x4F : 0x03));
+        QByteArray getresponse("\x00\xC0\x00\x00\x00", 5);
+        getresponse[0] = cla;
+        while ((sw & 0xFF00) == 0x6100 && data.size() < 0x10000) {
+            getresponse[4] = char(sw & 0xFF);
+            err = transmitRaw(getresponse, response);
+            if (err != SCARD_S_SUCCESS) {
+                return err;
+            }
+            // No status word, the data so far can not be trusted either
+            if (response.size() < 2) {
+                response.clear();
+                return SCARD_F_COMM_ERROR;
+            }
+            sw = statusWord(response);
+            data.append(response.constData(), response.size() - 2);
+        }
+        data.append(char(sw >> 8)).append(char(sw & 0xFF));
+        response = data;
+    }
+    return err;
+}
+
+// Transmit errors are fatal for the connection
+void QPCSCReaderWorker::transmitFailed(LONG err) {
+    if (!leaveChannel()) {
         SCard(Disconnect, card, SCARD_RESET_CARD);
-        card = 0;
-        return emit disconnected(err);
     }
-    response.resize(rlen);
-    _log("RECV %s", qPrintable(response.toHex()));
-    emit received(QByteArray((const char*)response.data(), int(response.size())));
+    card = 0;
+    releaseTransaction();
+    unschedule();
+    emit disconnected(err);
+}
+
+void QPCSCReaderWorker::transmit(const QByteArray &apdu) {
+    if (!dispatched) {
+        return schedule([this, apdu] { transmit(apdu); });
+    }
+    if (isWaiting()) {
+        return deferred.append([this, apdu] { transmit(apdu); });
+    }
+    QByteArray response;
+    LONG err = transceive(apdu, response);
+    if (err != SCARD_S_SUCCESS) {
+        return transmitFailed(err);
+    }
+    emit received(response);
+}
+
+void QPCSCReaderWorker::transmitBatch(const QList<QByteArray> &apdus) {
+    if (!dispatched) {
+        return schedule([this, apdus] { transmitBatch(apdus); });
+    }
+    if (isWaiting()) {
+        return deferred.append([this, apdus] { transmitBatch(apdus); });
+    }
+    QList<QByteArray> responses;
+    responses.reserve(apdus.size());
+    for (const auto &apdu: apdus) {
+        QByteArray response;
+        LONG err = transceive(apdu, response);
+        if (err != SCARD_S_SUCCESS) {
+            return transmitFailed(err);
+        }
+        responses.append(response);
+    }
+    emit receivedBatch(responses);
+}
+
+// Size of the EF from tag 80 of the FCP template, -1 if not known. Without
+// it the allocated size of tag 81 is an upper bound, and exact is false
+static int fileSize(const QByteArray &fcp, bool &exact) {
+    exact = false;
+    if (fcp.size() < 4 || quint8(fcp.at(0)) != 0x62) {
+        return -1;
+    }
+    int result = -1;
+    int end = qMin(fcp.size() - 2, 2 + quint8(fcp.at(1)));
+    for (int i = 2; i + 1 < end; i += 2 + quint8(fcp.at(i + 1))) {
+        quint8 tag = quint8(fcp.at(i));
+        int len = quint8(fcp.at(i + 1));
+        if ((tag == 0x80 || tag == 0x81) && len >= 1 && len <= 4 && i + 2 + len <= end) {
+            int size = 0;
+            for (int j = 0; j < len; j++) {
+                size = (size << 8) | quint8(fcp.at(i + 2 + j));
+            }
+            if (tag == 0x80) {
+                exact = true;
+                return size;
+            }
+            result = size;
+        }
+    }
+    return result;
+}
+
+void QPCSCReaderWorker::readFile(const QByteArray &path, int chunk) {
+    if (!dispatched) {
+        return schedule([this, path, chunk] { readFile(path, chunk); });
+    }
+    if (isWaiting()) {
+        return deferred.append([this, path, chunk] { readFile(path, chunk); });
+    }
+    QByteArray response;
+    LONG err = SCARD_S_SUCCESS;
+    // SELECT the FID-s in turn, asking for the FCP of the last one
+    for (int i = 0; i + 1 < path.size(); i += 2) {
+        bool last = i + 2 >= path.size();
+        QByteArray select = QByteArray::fromHex(last ? "00A4000402" : "00A4000C02") + path.mid(i, 2);
+        if (last)
+            select.append('\x00');
+        err = transceive(select, response, true);
+        if (err != SCARD_S_SUCCESS) {
+            return transmitFailed(err);
+        }
+        if (statusWord(response) != 0x9000) {
+            return emit fileRead(QByteArray(), statusWord(response));
+        }
+    }
+    bool exact = false;
+    int size = fileSize(response, exact);
+    _log("Reading %s of %s%d bytes in chunks of %d", qPrintable(path.toHex()), exact ? "" : "at most ", size, chunk);
+
+    // READ BINARY up to the size, or to the end of the file if it is not exact
+    QByteArray data;
+    while (size < 0 || data.size() < size) {
+        if (data.size() > 0x7FFF) {
+            return emit fileRead(QByteArray(), 0x6B00); // Offset does not fit P1-P2
+        }
+        int le = size < 0 ? chunk : qMin(chunk, size - data.size());
+        QByteArray read = QByteArray::fromHex("00B00000");
+        read[2] = char(data.size() >> 8);
+        read[3] = char(data.size() & 0xFF);
+        if (le <= 256) {
+            read.append(char(le & 0xFF));
+        } else {
+            read.append('\x00').append(char(le >> 8)).append(char(le & 0xFF));
+        }
+        err = transceive(read, response, true);
+        if (err != SCARD_S_SUCCESS) {
+            return transmitFailed(err);
+        }
+        quint16 sw = statusWord(response);
+        if (sw == 0x6700 && chunk > 1) {
+            // More than the card or the reader can take
+            chunk = qMin(chunk, 256) / 2;
+            continue;
+        }
+        if (sw == 0x6B00 && !exact) {
+            break; // Past the end
+        }
+        if (sw != 0x9000 && sw != 0x6282) {
+            return emit fileRead(QByteArray(), sw);
+        }
+        data.append(response.constData(), response.size() - 2);
+        // End of file reached
+        if (sw == 0x6282 || response.size() - 2 < le || response.size() == 2) {
+            break;
+        }
+    }
+    emit fileRead(data, 0x9000);
+}
+
+void QPCSCReaderWorker::runScript(const QList<APDUStep> &script) {
+    if (!dispatched) {
+        return schedule([this, script] { runScript(script); });
+    }
+    if (isWaiting()) {
+        return deferred.append([this, script] { runScript(script); });
+    }
+    QList<QByteArray> responses;
+    QVector<bool> matched(script.size(), false);
+    responses.reserve(script.size());
+    for (int i = 0; i < script.size(); i++) {
+        const APDUStep &step = script.at(i);
+        if ((step.when >= 0 && !matched[step.when]) || (step.unless >= 0 && matched[step.unless])) {
+            _log("Skipping step %d", i);
+            responses.append(QByteArray());
+            continue;
+        }
+        QByteArray apdu = step.bytes;
+        if (step.countStep >= 0) {
+            // Data of the earlier response, without the status word
+            const QByteArray &source = responses.at(step.countStep);
+            int into = step.countInto < 0 ? apdu.size() + step.countInto + 1 - step.countSize : step.countInto;
+            if (step.countOffset + step.countSize > source.size() - 2 || into < 0 || into + step.countSize > apdu.size()) {
+                _log("Step %d can not read count from step %d", i, step.countStep);
+                responses.append(QByteArray());
+                if (step.abort) {
+                    return emit receivedScript(responses, i);
+                }
+                continue;
+            }
+            for (int b = 0; b < step.countSize; b++) {
+                apdu[into + b] = source.at(step.countOffset + b);
+            }
+        }
+        QByteArray response;
+        LONG err = transceive(apdu, response);
+        if (err != SCARD_S_SUCCESS) {
+            return transmitFailed(err);
+        }
+        responses.append(response);
+        quint16 sw = statusWord(response);
+        matched[i] = (sw & step.mask) == (step.sw & step.mask);
+        if (!matched[i] && step.abort) {
+            _log("Step %d returned %04X, aborting", i, sw);
+            return emit receivedScript(responses, i);
+        }
+    }
+    emit receivedScript(responses, -1);
 }
@@ -7,6 +7,14 @@
 #include <QThread>
 #include <QMutex>
 #include <QPair>
+#include <QQueue>
+#include <QStringList>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "debuglog.h"
 
@@ -22,8 +30,173 @@
 
 class QtPCSC;
 
-// Lives in a separate thread because of possibly blocking
-// transmits, that owns the context and card handles
+// PC/SC entry points, called through the SCard() macro. The system library
+// by default, replaced by the simulator (qpcscsim.h) for tests and benchmarks.
+// Must be installed before QtPCSC is constructed
+struct QPCSCBackend {
+    LONG (*EstablishContext)(DWORD scope, LPCVOID reserved1, LPCVOID reserved2, LPSCARDCONTEXT context);
+    LONG (*ReleaseContext)(SCARDCONTEXT context);
+    LONG (*Cancel)(SCARDCONTEXT context);
+    LONG (*ListReaders)(SCARDCONTEXT context, LPCSTR groups, LPSTR readers, LPDWORD size);
+    LONG (*GetStatusChange)(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count);
+    LONG (*Connect)(SCARDCONTEXT context, LPCSTR reader, DWORD mode, DWORD protocols, LPSCARDHANDLE card, LPDWORD protocol);
+    LONG (*Reconnect)(SCARDHANDLE card, DWORD mode, DWORD protocols, DWORD initialization, LPDWORD protocol);
+    LONG (*Disconnect)(SCARDHANDLE card, DWORD disposition);
+    LONG (*BeginTransaction)(SCARDHANDLE card);
+    LONG (*EndTransaction)(SCARDHANDLE card, DWORD disposition);
+    LONG (*Status)(SCARDHANDLE card, LPSTR names, LPDWORD namesize, LPDWORD state, LPDWORD protocol, LPBYTE atr, LPDWORD atrsize);
+    LONG (*Transmit)(SCARDHANDLE card, const SCARD_IO_REQUEST *sendpci, const BYTE *send, DWORD sendsize, SCARD_IO_REQUEST *recvpci, LPBYTE recv, LPDWORD recvsize);
+
+    static QPCSCBackend system();
+    static const QPCSCBackend &current();
+    static void install(const QPCSCBackend &backend);
+};
+
+// A step of an APDU script, run in the reader thread without browser round trips
+struct APDUStep {
+    QByteArray bytes; // command APDU
+    quint16 sw = 0x9000; // expected status word
+    quint16 mask = 0xFFFF; // compared after masking
+    int when = -1; // run only if this earlier step matched
+    int unless = -1; // run only if this earlier step did not match (or was skipped)
+    bool abort = false; // stop the script if the status word does not match
+    // Patch the command with a count from the response of an earlier step
+    int countStep = -1;
+    int countOffset = 0; // offset of the count in the response data
+    int countSize = 1; // 1 or 2 bytes, big endian
+    int countInto = -1; // offset in the command, negative counts from the end
+};
+Q_DECLARE_METATYPE(APDUStep)
+
+// Cancelled when the web context goes away, checked before every command and APDU
+class QPCSCCancelToken {
+public:
+    void cancel() {
+        flag->store(true);
+    };
+    bool isCancelled() const {
+        return flag->load();
+    };
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag = std::make_shared<std::atomic<bool>>(false);
+};
+
+// Connection options, from SCardConnect parameters
+struct QPCSCOptions {
+    bool autoResponse = false; // follow 61xx and 6Cxx chains in the worker
+    QString origin; // of the web context
+    int keepWarm = 0; // seconds to keep the card connected after disconnect
+    QByteArray atr; // of the card in the reader when connecting, for cached negotiation
+    bool implicitTransaction = true; // hold the transaction from connect to disconnect
+    bool logicalChannels = false; // share the card with other such connections on logical channels
+    QPCSCCancelToken cancel; // of the web context
+};
+Q_DECLARE_METATYPE(QPCSCOptions)
+
+// State of a reader: the SCARD_STATE_* bits of the last status change and the ATR.
+// Names are only made for logging and JSON
+struct QPCSCReaderState {
+    DWORD state = SCARD_STATE_UNAWARE;
+    QByteArray atr;
+
+    bool isPresent() const {
+        return state & SCARD_STATE_PRESENT;
+    };
+    bool isMute() const {
+        return state & SCARD_STATE_MUTE;
+    };
+    bool isExclusive() const {
+        return state & SCARD_STATE_EXCLUSIVE;
+    };
+    QStringList names() const;
+};
+Q_DECLARE_METATYPE(QPCSCReaderState)
+
+class QPCSCReaderWorker;
+
+// PC/SC I/O threads, owned by QtPCSC. Each reader has a thread of its own,
+// which serves all connections to the reader and keeps them serialized, so
+// a blocking call only stalls its own reader. The thread is started on first
+// use and stopped once the reader is removed and its last worker is gone.
+class QPCSCIOThreads {
+public:
+    QPCSCIOThreads();
+    ~QPCSCIOThreads();
+
+    // Called from main thread
+    QThread *threadFor(const QString &reader); // for a new worker
+    void release(const QString &reader); // a worker is gone
+    void readerRemoved(const QString &reader);
+
+    // A card kept connected after disconnect, for the next connection to the reader
+    struct WarmCard {
+        SCARDHANDLE card = 0;
+        DWORD protocol = SCARD_PROTOCOL_UNDEFINED;
+        QByteArray atr;
+        QString origin;
+        quint64 serial = 0;
+    };
+
+    // State of an I/O thread, only accessed from the thread itself
+    struct State {
+        ~State();
+        SCARDCONTEXT context = 0; // Kept between connections
+        QMap<QString, QPCSCReaderWorker *> holders; // Holding the transaction of a reader
+        QMap<QString, QList<QPCSCReaderWorker *>> waiting; // Waiting for the transaction
+        QMap<QString, WarmCard> warm; // By reader
+        quint64 serial = 0;
+
+        // Commands of a connection, with statistics
+        struct Queue {
+            QQueue<QPair<qint64, std::function<void()>>> commands; // With the time queued at, in ns
+            quint64 served = 0;
+            qint64 waited = 0; // ns, in total
+            qint64 maxWait = 0;
+            int maxDepth = 0;
+        };
+        // Connections to a reader take turns, one command at a time, so that
+        // a connection with many queued commands does not starve the others
+        struct Scheduler {
+            QList<QPCSCReaderWorker *> turns; // Round-robin order, the first is next
+            QMap<QPCSCReaderWorker *, Queue> queues;
+            int depth = 0; // Commands queued for the reader
+            int maxDepth = 0;
+            bool posted = false;
+        };
+        QMap<QString, Scheduler> schedulers; // By reader
+
+        // A card handle shared by connections on logical channels, the
+        // first one uses the basic channel and the handle is disconnected
+        // by the last one
+        struct ChannelCard {
+            SCARDHANDLE card = 0;
+            DWORD protocol = SCARD_PROTOCOL_UNDEFINED;
+            DWORD mode = SCARD_SHARE_EXCLUSIVE;
+            QByteArray atr;
+            QList<QPCSCReaderWorker *> users;
+            QList<QPCSCReaderWorker *> transacted; // In the transaction on the handle, the holder among them
+        };
+        QMap<QString, ChannelCard> channelCards; // By reader
+        QObject dispatcher; // Lives in the thread, runs the schedulers
+        QByteArray buffer; // Receive buffer of all connections, responses are copied out
+    };
+    static State &state();
+    // Context of the current thread, re-established if fresh is set
+    static LONG context(SCARDCONTEXT &context, bool fresh = false);
+
+private:
+    struct Thread {
+        QThread *thread = nullptr;
+        int workers = 0;
+        bool removed = false;
+    };
+    void stop(const QString &reader);
+    QMap<QString, Thread> threads; // By reader
+};
+
+// Lives in the I/O thread of its reader because of possibly blocking
+// transmits, owns the card handle
 class QPCSCReaderWorker: public QObject {
     Q_OBJECT
 
@@ -32,10 +205,20 @@ public:
 
 public slots:
     // establish context in thread and connect to reader
-    void connectCard(const QString &reader, const QString &protocol);
+    void connectCard(const QString &reader, const QString &protocol, const QPCSCOptions &options);
     void transmit(const QByteArray &bytes);
+    // send all APDU-s back-to-back, reply with all responses at once
+    void transmitBatch(const QList<QByteArray> &apdus);
+    void runScript(const QList<APDUStep> &script);
     void reconnectCard(const QString &protocol);
     void disconnectCard();
+    // explicit transactions, waiting in line if another connection holds it
+    void beginCardTransaction();
+    void endCardTransaction();
+    // SELECT the FID-s of the path in turn and read the whole EF in chunks of at most chunk bytes
+    void readFile(const QByteArray &path, int chunk);
+    // The web context went away
+    void abandon();
 
 signals:
     // When the connection has been established
@@ -46,28 +229,64 @@ signals:
     void disconnected(const LONG err);
     // bytes received from the card after transmit()
     void received(const QByteArray &bytes);
+    // responses from the card after transmitBatch(), in the same order
+    void receivedBatch(const QList<QByteArray> &responses);
+    // responses after runScript(), empty for skipped steps. aborted is the index of the aborting step or -1
+    void receivedScript(const QList<QByteArray> &responses, int aborted);
+    // contents after readFile(), sw is the status word of the failed command if not 0x9000
+    void fileRead(const QByteArray &data, quint16 sw);
+    // after beginCardTransaction() and endCardTransaction()
+    void transactionStarted(const LONG err);
+    void transactionEnded(const LONG err);
 
 private:
-    SCARDCONTEXT context = 0; // Only required on unix
+    LONG transmitRaw(const QByteArray &command, QByteArray &response);
+    LONG transceive(const QByteArray &apdu, QByteArray &response, bool follow = false);
+    void transmitFailed(LONG err);
+    void schedule(std::function<void()> command);
+    void unschedule();
+    static void runScheduled(const QString &reader);
+    void ready();
+    bool openChannel();
+    bool manageChannel();
+    bool leaveChannel();
+    QPCSCIOThreads::State::ChannelCard *channelCard();
+    void beginTransaction();
+    void releaseTransaction();
+    bool isWaiting();
+    bool cancelWait();
+    void runDeferred();
+    bool parkCard();
+    bool adoptCard(DWORD proto);
+
+    SCARDCONTEXT context = 0; // Only required on unix, owned by the thread
     SCARDHANDLE card = 0;
     DWORD protocol = SCARD_PROTOCOL_UNDEFINED;
     DWORD mode = SCARD_SHARE_EXCLUSIVE;
     QString name;
+    QByteArray atr;
+    QPCSCOptions options;
+    bool announced = false; // connected() has been emitted
+    bool abandoned = false;
+    int channel = 0; // Logical channel on a shared card
+    bool dispatched = false; // Running a command taken from the scheduler
+    // Commands received while waiting in line for an explicit transaction
+    QList<std::function<void()>> deferred;
 };
 
 // Represents a connection to a reader and a card.
-// It lives in main thread but has a worker thread
+// It lives in main thread but has a worker in the I/O thread of the reader
 class QPCSCReader: public QObject {
     Q_OBJECT
 public:
-    QPCSCReader(WebContext *webcontext, QtPCSC *pcsc, const QString &name, const QString &proto): QObject(webcontext), name(name), PCSC(pcsc), protocol(proto) {
+    QPCSCReader(WebContext *webcontext, QtPCSC *pcsc, const QString &name, const QString &proto, const QPCSCOptions &options): QObject(webcontext), name(name), PCSC(pcsc), protocol(proto), options(options) {
         setObjectName(name);
     };
 
     ~QPCSCReader() {
-        if (thread.isRunning()) {
-            thread.quit();
-            thread.wait();
+        // Deleted in the I/O thread after pending commands
+        if (worker) {
+            worker->deleteLater();
         }
     }
 
@@ -79,34 +298,56 @@ public:
 public slots:
     void open();
     void transmit(const QByteArray &apdu);
+    void transmitBatch(const QList<QByteArray> &apdus);
+    void runScript(const QList<APDUStep> &script);
     void reconnect(const QString &protocol);
     void disconnect();
+    void beginTransaction();
+    void endTransaction();
+    void readFile(const QByteArray &path, int chunk);
+    void abandon();
 
-    void cardInserted(const QString &reader, const QByteArray &atr, const QStringList &flags);
+    void cardInserted(const QString &reader, const QPCSCReaderState &state);
     void readerRemoved(const QString &reader);
 
 signals:
     // command signals
-    void connectCard(const QString &reader, const QString &protocol);
+    void connectCard(const QString &reader, const QString &protocol, const QPCSCOptions &options);
     void reconnectCard(const QString &protocol);
     void disconnectCard();
     void transmitBytes(const QByteArray &bytes);
+    void transmitBatchBytes(const QList<QByteArray> &apdus);
+    void transmitScript(const QList<APDUStep> &script);
+    void beginCardTransaction();
+    void endCardTransaction();
+    void readCardFile(const QByteArray &path, int chunk);
+    void abandonCard();
 
     // Proxied signals
     void received(const QByteArray &apdu);
+    void receivedBatch(const QList<QByteArray> &responses);
+    void receivedScript(const QList<QByteArray> &responses, int aborted);
+    void fileRead(const QByteArray &data, quint16 sw);
     void disconnected(const LONG err);
     void connected(const QByteArray &atr, const QString &protocol);
     void reconnected(const QByteArray &atr, const QString &protocol);
+    void transactionStarted(const LONG err);
+    void transactionEnded(const LONG err);
 
 private:
     bool isOpen = false;
     QtPCSC *PCSC;
     QString protocol;
-    QThread thread;
-    QPCSCReaderWorker worker;
+    QPCSCOptions options;
+    QPCSCReaderWorker *worker = nullptr;
 };
 
 
+// Immutable view of the known readers, replaced as a whole on every change
+struct QPCSCReaderSnapshot {
+    QMap<QString, QPCSCReaderState> readers;
+};
+
 class QPCSCEventWorker: public QObject {
     Q_OBJECT
 
@@ -124,29 +365,49 @@ public slots:
         return cancelHandle;
     };
 #endif
-    QMap<QString, QPair<QByteArray, QStringList>> getReaders();
+    // Thread safe, does not take the PC/SC mutex
+    QMap<QString, QPCSCReaderState> getReaders();
 
 signals:
     void stopped(LONG rv);
     void started();
 
-    void cardInserted(const QString &reader, const QByteArray &atr, const QStringList flags);
+    void cardInserted(const QString &reader, const QPCSCReaderState &state);
     void cardRemoved(const QString &reader);
 
     void readerAttached(const QString &name);
     void readerRemoved(const QString &name);
 
-    void readerChanged(const QString &reader, const QByteArray &atr, const QStringList flags);
+    void readerChanged(const QString &reader, const QPCSCReaderState &state);
 
-    void readerListChanged(const QMap<QString, QPair<QByteArray, QStringList>> &readers); // if any of the above triggered, this will trigger as well
+    void readerListChanged(const QMap<QString, QPCSCReaderState> &readers); // if any of the above triggered, this will trigger as well
 
 private:
     LONG generate();
+    void flush();
+    void publish();
     SCARDCONTEXT context = 0;
     bool pnp = true;
     const char *pnpReaderName = "\\\\?PnP?\\Notification";
-    QMap<QString, QPair<QByteArray, DWORD>> known; // Known readers
-    QMutex mutex; // Lock that guards the known readers
+    // Flat table of known readers, in the order of the status query. Names are
+    // converted once when a reader appears and only the states change in between
+    struct Reader {
+        std::string name; // szReader of the status query points here
+        QString qname;
+        QByteArray atr;
+        DWORD state = SCARD_STATE_UNAWARE;
+        bool emptied = false; // Seen without a card since the last flush
+        QPCSCReaderState current() const {
+            QPCSCReaderState result;
+            result.state = state;
+            result.atr = atr;
+            return result;
+        };
+    };
+    std::vector<Reader> known; // Known readers, only accessed from event thread
+    QMap<QString, QPCSCReaderState> announced; // As last emitted, from event thread
+    std::shared_ptr<const QPCSCReaderSnapshot> snapshot = std::make_shared<QPCSCReaderSnapshot>(); // Published with atomic store
+    QMutex mutex; // Lock that guards the context
 #ifdef Q_OS_WIN
     HANDLE cancelHandle = NULL;
 #endif
@@ -173,6 +434,9 @@ public:
         connect(&worker, &QPCSCEventWorker::cardRemoved, this, &QtPCSC::cardRemoved, Qt::QueuedConnection);
         connect(&worker, &QPCSCEventWorker::readerAttached, this, &QtPCSC::readerAttached, Qt::QueuedConnection);
         connect(&worker, &QPCSCEventWorker::readerRemoved, this, &QtPCSC::readerRemoved, Qt::QueuedConnection);
+        connect(this, &QtPCSC::readerRemoved, this, [this] (const QString &name) {
+            ioThreads.readerRemoved(name);
+        });
         connect(&worker, &QPCSCEventWorker::readerChanged, this, &QtPCSC::readerChanged, Qt::QueuedConnection);
         connect(&worker, &QPCSCEventWorker::readerListChanged, this, &QtPCSC::readerListChanged, Qt::QueuedConnection);
         connect(this, &QtPCSC::startSignal, &worker, &QPCSCEventWorker::start, Qt::QueuedConnection);
@@ -181,8 +445,14 @@ public:
 
     void cancel();
 
-    QMap<QString, QPair<QByteArray, QStringList>> getReaders();
-    QPCSCReader *connectReader(WebContext *webcontext, const QString &reader, const QString &protocol, bool wait);
+    QMap<QString, QPCSCReaderState> getReaders();
+    QPCSCReader *connectReader(WebContext *webcontext, const QString &reader, const QString &protocol, const QPCSCOptions &options, bool wait);
+    QThread *readerThread(const QString &reader) {
+        return ioThreads.threadFor(reader);
+    };
+    void releaseReaderThread(const QString &reader) {
+        ioThreads.release(reader);
+    };
 
     static const char *errorName(LONG err);
 
@@ -201,15 +471,15 @@ public:
         thread.wait();
     }
 signals:
-    void cardInserted(const QString &reader, const QByteArray &atr, const QStringList flags);
+    void cardInserted(const QString &reader, const QPCSCReaderState &state);
     void cardRemoved(const QString &reader);
 
     void readerAttached(const QString &name);
     void readerRemoved(const QString &name);
 
-    void readerListChanged(const QMap<QString, QPair<QByteArray, QStringList>> &readers); // if any of the above triggered, this will trigger as well
+    void readerListChanged(const QMap<QString, QPCSCReaderState> &readers); // if any of the above triggered, this will trigger as well
 
-    void readerChanged(const QString &reader, const QByteArray &atr, const QStringList flags);
+    void readerChanged(const QString &reader, const QPCSCReaderState &state);
 
     void error(const QString &reader, const LONG err);
 
@@ -221,4 +491,5 @@ private:
 
     QThread thread;
     QPCSCEventWorker worker;
+    QPCSCIOThreads ioThreads;
 };
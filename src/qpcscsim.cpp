@@ -0,0 +1,711 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#include "qpcscsim.h"
+#include "apdutrace.h"
+
+#include <cstring>
+#include <algorithm>
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QMutexLocker>
+
+static const char *pnpReaderName = "\\\\?PnP?\\Notification";
+static const QByteArray MF = QByteArray::fromHex("3F00");
+// Traces do not have the ATR
+static const QByteArray traceATR = QByteArray::fromHex("3BFA1800008031FE45FE654944202F20504B4903");
+
+static QByteArray sw(quint16 sw) {
+    QByteArray result(2, 0);
+    result[0] = char(sw >> 8);
+    result[1] = char(sw & 0xFF);
+    return result;
+}
+
+// Le of a case 2 command, short or extended
+static int expectedLength(const QByteArray &apdu) {
+    if (apdu.size() == 5)
+        return apdu.at(4) == 0 ? 256 : quint8(apdu.at(4));
+    if (apdu.size() == 7 && apdu.at(4) == 0) {
+        int le = (quint8(apdu.at(5)) << 8) | quint8(apdu.at(6));
+        return le == 0 ? 65536 : le;
+    }
+    return 256;
+}
+
+QPCSCSimulator *QPCSCSimulator::instance() {
+    static QPCSCSimulator simulator;
+    return &simulator;
+}
+
+// Only set before PC/SC is started
+bool QPCSCSimulator::isActive() {
+    return instance()->active;
+}
+
+QPCSCSimulator::Card QPCSCSimulator::parseCard(const QJsonObject &card) {
+    Card result;
+    result.atr = QByteArray::fromHex(card.value("atr").toString().toLatin1());
+    result.protocol = card.value("protocol").toString() == "T=0" ? SCARD_PROTOCOL_T0 : SCARD_PROTOCOL_T1;
+    result.latency = card.value("latency").toInt(0) * 1000;
+    result.mute = card.value("mute").toBool(false);
+    result.getResponse = card.value("getResponse").toBool(false);
+    result.channels = card.value("channels").toInt(4);
+    for (const auto &v: card.value("apdus").toArray()) {
+        QJsonObject o = v.toObject();
+        APDU apdu;
+        QString command = o.value("command").toString();
+        apdu.prefix = command.endsWith("*");
+        apdu.command = QByteArray::fromHex(command.toLatin1());
+        apdu.response = QByteArray::fromHex(o.value("response").toString().toLatin1());
+        apdu.latency = o.value("latency").toInt(-1);
+        if (apdu.latency > 0)
+            apdu.latency *= 1000;
+        result.apdus.append(apdu);
+    }
+    QJsonObject files = card.value("files").toObject();
+    for (auto i = files.constBegin(); i != files.constEnd(); ++i) {
+        result.files[QByteArray::fromHex(i.key().toLatin1())] = QByteArray::fromHex(i.value().toString().toLatin1());
+    }
+    return result;
+}
+
+// A reader with a replaying card for every reader in the trace
+bool QPCSCSimulator::loadTrace(const QByteArray &data, bool timings) {
+    QList<APDUTrace::Exchange> exchanges;
+    if (!APDUTrace::parse(data, exchanges))
+        return false;
+    for (const auto &e: exchanges) {
+        // Failed transmits did not reach the card
+        if (e.result != SCARD_S_SUCCESS)
+            continue;
+        Reader *r = find(e.reader);
+        if (!r) {
+            Reader reader;
+            reader.name = e.reader;
+            reader.card.atr = traceATR;
+            reader.present = true;
+            reader.generation = 1;
+            reset(reader);
+            readers.append(reader);
+            r = &readers.last();
+        }
+        APDU apdu;
+        apdu.command = e.command;
+        apdu.response = e.response;
+        apdu.latency = timings ? int(e.duration / 1000) : 0;
+        r->card.replay.append(apdu);
+    }
+    return true;
+}
+
+bool QPCSCSimulator::load(const QString &path) {
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        _log("Could not open %s", qPrintable(path));
+        return false;
+    }
+    QByteArray data = f.readAll();
+    QPCSCSimulator *sim = instance();
+    QMutexLocker locker(&sim->mutex);
+
+    QJsonDocument doc;
+    if (data.startsWith("WEIDTRC1")) {
+        if (!sim->loadTrace(data, true)) {
+            _log("Invalid trace %s", qPrintable(path));
+            return false;
+        }
+    } else {
+        QJsonParseError error;
+        doc = QJsonDocument::fromJson(data, &error);
+        if (!doc.isObject()) {
+            _log("Invalid simulation %s: %s", qPrintable(path), qPrintable(error.errorString()));
+            return false;
+        }
+    }
+    for (const auto &v: doc.object().value("readers").toArray()) {
+        QJsonObject o = v.toObject();
+        Reader r;
+        r.name = o.value("name").toString();
+        if (o.contains("card")) {
+            r.card = parseCard(o.value("card").toObject());
+            r.present = o.value("inserted").toBool(true);
+            r.generation = 1;
+        }
+        sim->reset(r);
+        sim->readers.append(r);
+    }
+    for (const auto &v: doc.object().value("events").toArray()) {
+        QJsonObject o = v.toObject();
+        Event e;
+        e.at = o.value("at").toInt();
+        e.reader = o.value("reader").toString();
+        e.event = o.value("event").toString();
+        e.card = o.value("card").toObject();
+        sim->events.append(e);
+    }
+    if (doc.object().contains("trace")) {
+        QString trace = doc.object().value("trace").toString();
+        QFile t(QFileInfo(path).dir().filePath(trace)); // relative to the simulation
+        if (!t.open(QIODevice::ReadOnly) || !sim->loadTrace(t.readAll(), doc.object().value("traceLatency").toBool(true))) {
+            _log("Invalid trace %s", qPrintable(trace));
+            return false;
+        }
+    }
+    std::stable_sort(sim->events.begin(), sim->events.end(), [] (const Event &a, const Event &b) {
+        return a.at < b.at;
+    });
+    sim->version = 1;
+    sim->clock.start();
+
+    QPCSCBackend b;
+    b.EstablishContext = [] (DWORD, LPCVOID, LPCVOID, LPSCARDCONTEXT context) -> LONG {
+        return instance()->establishContext(context);
+    };
+    b.ReleaseContext = [] (SCARDCONTEXT context) -> LONG {
+        return instance()->releaseContext(context);
+    };
+    b.Cancel = [] (SCARDCONTEXT context) -> LONG {
+        return instance()->cancel(context);
+    };
+    b.ListReaders = [] (SCARDCONTEXT context, LPCSTR, LPSTR readers, LPDWORD size) -> LONG {
+        return instance()->listReaders(context, readers, size);
+    };
+    b.GetStatusChange = [] (SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count) -> LONG {
+        return instance()->getStatusChange(context, timeout, states, count);
+    };
+    b.Connect = [] (SCARDCONTEXT context, LPCSTR reader, DWORD mode, DWORD protocols, LPSCARDHANDLE card, LPDWORD protocol) -> LONG {
+        return instance()->connect(context, reader, mode, protocols, card, protocol);
+    };
+    b.Reconnect = [] (SCARDHANDLE card, DWORD mode, DWORD protocols, DWORD initialization, LPDWORD protocol) -> LONG {
+        return instance()->reconnect(card, mode, protocols, initialization, protocol);
+    };
+    b.Disconnect = [] (SCARDHANDLE card, DWORD disposition) -> LONG {
+        return instance()->disconnect(card, disposition);
+    };
+    b.BeginTransaction = [] (SCARDHANDLE card) -> LONG {
+        return instance()->beginTransaction(card);
+    };
+    b.EndTransaction = [] (SCARDHANDLE card, DWORD disposition) -> LONG {
+        return instance()->endTransaction(card, disposition);
+    };
+    b.Status = [] (SCARDHANDLE card, LPSTR names, LPDWORD namesize, LPDWORD state, LPDWORD protocol, LPBYTE atr, LPDWORD atrsize) -> LONG {
+        return instance()->status(card, names, namesize, state, protocol, atr, atrsize);
+    };
+    b.Transmit = [] (SCARDHANDLE card, const SCARD_IO_REQUEST *, const BYTE *send, DWORD sendsize, SCARD_IO_REQUEST *, LPBYTE recv, LPDWORD recvsize) -> LONG {
+        return instance()->transmit(card, send, sendsize, recv, recvsize);
+    };
+    QPCSCBackend::install(b);
+    sim->active = true;
+    _log("Simulating %d readers and %d events from %s", sim->readers.size(), sim->events.size(), qPrintable(path));
+    return true;
+}
+
+// The rest is called with the mutex held
+QPCSCSimulator::Reader *QPCSCSimulator::find(const QString &name) {
+    for (auto &r: readers) {
+        if (r.name == name)
+            return &r;
+    }
+    return nullptr;
+}
+
+void QPCSCSimulator::applyEvents() {
+    bool applied = false;
+    while (!events.isEmpty() && events.first().at <= clock.elapsed()) {
+        apply(events.takeFirst());
+        applied = true;
+    }
+    if (applied)
+        changed.wakeAll();
+}
+
+void QPCSCSimulator::apply(const Event &event) {
+    _log("Simulating %s in %s", qPrintable(event.event), qPrintable(event.reader));
+    Reader *r = find(event.reader);
+    if (event.event == "attach") {
+        if (!r) {
+            readers.append(Reader());
+            r = &readers.last();
+            r->name = event.reader;
+            r->attached = false;
+        }
+        if (r->attached)
+            return;
+        r->attached = true;
+        version++;
+    } else if (!r) {
+        _log("Unknown simulated reader %s", qPrintable(event.reader));
+        return;
+    } else if (event.event == "detach") {
+        r->attached = false;
+        r->transaction = 0;
+        version++;
+    } else if (event.event == "remove") {
+        r->present = false;
+        r->transaction = 0;
+    } else if (event.event != "insert") {
+        _log("Unknown simulated event %s", qPrintable(event.event));
+        return;
+    }
+    if (!event.card.isEmpty()) {
+        r->card = parseCard(event.card);
+    }
+    if (event.event == "insert" || (event.event == "attach" && !event.card.isEmpty())) {
+        r->present = true;
+        r->generation++;
+        r->transaction = 0;
+        reset(*r);
+    }
+    r->events++;
+}
+
+void QPCSCSimulator::reset(Reader &reader) {
+    reader.channels.clear();
+    reader.channels[0].selected = MF;
+}
+
+LONG QPCSCSimulator::check(SCARDHANDLE card, Handle *&handle, Reader *&reader) {
+    auto i = handles.find(card);
+    if (i == handles.end())
+        return SCARD_E_INVALID_HANDLE;
+    handle = &i.value();
+    reader = find(handle->reader);
+    if (!reader || !reader->attached)
+        return SCARD_E_READER_UNAVAILABLE;
+    if (!reader->present || handle->generation != reader->generation)
+        return SCARD_W_REMOVED_CARD;
+    if (handle->resets != reader->resets)
+        return SCARD_W_RESET_CARD;
+    return SCARD_S_SUCCESS;
+}
+
+// Card model
+QByteArray QPCSCSimulator::process(Reader &reader, const QByteArray &apdu, int &latency) {
+    const Card &card = reader.card;
+    latency = card.latency;
+    if (!card.replay.isEmpty()) {
+        const APDU &a = card.replay.at(reader.replayed++ % card.replay.size());
+        latency = a.latency;
+        return a.response;
+    }
+    // Logical channel of an inter-industry class, in the first or further form
+    int channel = 0;
+    QByteArray command = apdu;
+    if (!apdu.isEmpty() && !(quint8(apdu.at(0)) & 0x80)) {
+        quint8 cla = quint8(apdu.at(0));
+        if (cla & 0x40) {
+            channel = 4 + (cla & 0x0F);
+            command[0] = char((cla & 0x10) | ((cla & 0x20) ? 0x08 : 0x00));
+        } else {
+            channel = cla & 0x03;
+            command[0] = char(cla & 0xFC);
+        }
+    }
+    if (!reader.channels.contains(channel))
+        return sw(0x6881);
+    Reader::Channel &current = reader.channels[channel];
+
+    for (const auto &a: card.apdus) {
+        if (a.prefix ? command.startsWith(a.command) : command == a.command) {
+            if (a.latency >= 0)
+                latency = a.latency;
+            return a.response;
+        }
+    }
+    if (apdu.size() < 4)
+        return sw(0x6700);
+
+    quint8 ins = quint8(apdu.at(1));
+    quint8 p1 = quint8(apdu.at(2));
+    quint8 p2 = quint8(apdu.at(3));
+
+    if (ins == 0xC0) {
+        if (current.pending.isEmpty())
+            return sw(0x6985);
+        QByteArray result = current.pending.left(expectedLength(apdu));
+        current.pending.remove(0, result.size());
+        if (current.pending.isEmpty())
+            return result + sw(0x9000);
+        return result + sw(quint16(0x6100 | (current.pending.size() > 0xFF ? 0 : current.pending.size())));
+    }
+    current.pending.clear();
+
+    // MANAGE CHANNEL, the card assigns the number and a new channel starts at the MF
+    if (ins == 0x70) {
+        if (p1 == 0x00 && p2 == 0x00) {
+            for (int n = 1; n < card.channels; n++) {
+                if (!reader.channels.contains(n)) {
+                    reader.channels[n].selected = MF;
+                    return QByteArray(1, char(n)) + sw(0x9000);
+                }
+            }
+            return sw(0x6A81);
+        }
+        int n = p2 ? p2 : channel;
+        if (p1 == 0x80 && n > 0 && reader.channels.remove(n))
+            return sw(0x9000);
+        return sw(0x6A86);
+    }
+
+    // A DF is the MF or has files below it
+    auto isDF = [&card] (const QByteArray &path) {
+        if (path == MF)
+            return true;
+        for (const auto &f: card.files.keys()) {
+            if (f.size() > path.size() && f.startsWith(path))
+                return true;
+        }
+        return false;
+    };
+    auto exists = [&card, &isDF] (const QByteArray &path) {
+        return card.files.contains(path) || isDF(path);
+    };
+
+    if (ins == 0xA4) {
+        QByteArray data = apdu.size() > 5 ? apdu.mid(5, quint8(apdu.at(4))) : QByteArray();
+        QByteArray df = isDF(current.selected) ? current.selected : current.selected.left(current.selected.size() - 2);
+        QByteArray path;
+        if (p1 == 0x00 && (data.isEmpty() || data == MF)) {
+            path = MF;
+        } else if (p1 == 0x00 && data.size() == 2) {
+            // Child of the current DF or a sibling of it
+            path = df + data;
+            if (!exists(path) && df.size() > 2)
+                path = df.left(df.size() - 2) + data;
+        } else if (p1 == 0x08) {
+            path = MF + data;
+        } else if (p1 == 0x09) {
+            path = df + data;
+        } else {
+            return sw(0x6A86);
+        }
+        if (!exists(path))
+            return sw(0x6A82);
+        current.selected = path;
+        if ((p2 & 0x0C) == 0x0C)
+            return sw(0x9000);
+        // FCP with size, descriptor and identifier
+        int size = card.files.value(path).size();
+        QByteArray fcp = QByteArray::fromHex("8002") + sw(quint16(size));
+        fcp += QByteArray::fromHex(isDF(path) ? "820138" : "820101");
+        fcp += QByteArray::fromHex("8302") + path.right(2);
+        fcp.prepend(char(fcp.size()));
+        fcp.prepend(char(0x62));
+        if (card.getResponse) {
+            current.pending = fcp;
+            return sw(quint16(0x6100 | fcp.size()));
+        }
+        return fcp + sw(0x9000);
+    }
+
+    if (ins == 0xB0) {
+        if (p1 & 0x80)
+            return sw(0x6A81);
+        if (!card.files.contains(current.selected) || isDF(current.selected))
+            return sw(0x6986);
+        const QByteArray &contents = card.files[current.selected];
+        int offset = (p1 << 8) | p2;
+        if (offset >= contents.size())
+            return sw(0x6B00);
+        int le = expectedLength(apdu);
+        QByteArray result = contents.mid(offset, le);
+        return result + sw(result.size() < le ? 0x6282 : 0x9000);
+    }
+    return sw(0x6D00);
+}
+
+// PC/SC API
+LONG QPCSCSimulator::establishContext(LPSCARDCONTEXT context) {
+    QMutexLocker locker(&mutex);
+    *context = ++lastContext;
+    contexts[*context] = false;
+    return SCARD_S_SUCCESS;
+}
+
+LONG QPCSCSimulator::releaseContext(SCARDCONTEXT context) {
+    QMutexLocker locker(&mutex);
+    if (!contexts.remove(context))
+        return SCARD_E_INVALID_HANDLE;
+    // Handles of the context are gone as well
+    for (auto i = handles.begin(); i != handles.end();) {
+        if (i.value().context == context) {
+            Reader *r = find(i.value().reader);
+            if (r && r->transaction == i.key())
+                r->transaction = 0;
+            i = handles.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    changed.wakeAll();
+    return SCARD_S_SUCCESS;
+}
+
+LONG QPCSCSimulator::cancel(SCARDCONTEXT context) {
+    QMutexLocker locker(&mutex);
+    if (!contexts.contains(context))
+        return SCARD_E_INVALID_HANDLE;
+    contexts[context] = true;
+    changed.wakeAll();
+    return SCARD_S_SUCCESS;
+}
+
+LONG QPCSCSimulator::listReaders(SCARDCONTEXT context, LPSTR names, LPDWORD size) {
+    QMutexLocker locker(&mutex);
+    if (!contexts.contains(context))
+        return SCARD_E_INVALID_HANDLE;
+    applyEvents();
+    QByteArray list;
+    for (const auto &r: readers) {
+        if (r.attached)
+            list += r.name.toUtf8() + '\0';
+    }
+    if (list.isEmpty()) {
+        *size = 0;
+        return SCARD_E_NO_READERS_AVAILABLE;
+    }
+    list += '\0';
+    if (names != nullptr && *size < DWORD(list.size())) {
+        *size = DWORD(list.size());
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    if (names != nullptr)
+        memcpy(names, list.constData(), size_t(list.size()));
+    *size = DWORD(list.size());
+    return SCARD_S_SUCCESS;
+}
+
+LONG QPCSCSimulator::getStatusChange(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count) {
+    QMutexLocker locker(&mutex);
+    qint64 deadline = timeout == INFINITE ? -1 : clock.elapsed() + timeout;
+    for (;;) {
+        applyEvents();
+        if (!contexts.contains(context))
+            return SCARD_E_INVALID_HANDLE;
+        if (contexts[context]) {
+            contexts[context] = false;
+            return SCARD_E_CANCELLED;
+        }
+        bool change = false;
+        for (DWORD k = 0; k < count; k++) {
+            SCARD_READERSTATE &s = states[k];
+            DWORD current = s.dwCurrentState & ~SCARD_STATE_CHANGED;
+            s.cbAtr = 0;
+            if (strcmp(s.szReader, pnpReaderName) == 0) {
+                // The high word changes with the reader list
+                s.dwEventState = DWORD(version) << 16;
+            } else {
+                Reader *r = find(QString::fromUtf8(s.szReader));
+                if (!r || !r->attached) {
+                    s.dwEventState = SCARD_STATE_UNKNOWN;
+                } else if (!r->present) {
+                    s.dwEventState = SCARD_STATE_EMPTY | (DWORD(r->events) << 16);
+                } else {
+                    s.dwEventState = SCARD_STATE_PRESENT | (DWORD(r->events) << 16);
+                    if (r->card.mute)
+                        s.dwEventState |= SCARD_STATE_MUTE;
+                    for (const auto &h: handles) {
+                        if (h.reader == r->name) {
+                            s.dwEventState |= SCARD_STATE_INUSE;
+                            if (h.mode == SCARD_SHARE_EXCLUSIVE)
+                                s.dwEventState |= SCARD_STATE_EXCLUSIVE;
+                        }
+                    }
+                    s.cbAtr = DWORD(qMin(r->card.atr.size(), int(sizeof(s.rgbAtr))));
+                    memcpy(s.rgbAtr, r->card.atr.constData(), s.cbAtr);
+                }
+            }
+            if (s.dwEventState != current) {
+                s.dwEventState |= SCARD_STATE_CHANGED;
+                change = true;
+            }
+        }
+        if (change)
+            return SCARD_S_SUCCESS;
+
+        // Wait for a change, the timeout or the next event
+        qint64 now = clock.elapsed();
+        if (deadline >= 0 && now >= deadline)
+            return SCARD_E_TIMEOUT;
+        qint64 wait = deadline >= 0 ? deadline - now : -1;
+        if (!events.isEmpty()) {
+            qint64 due = qMax<qint64>(0, events.first().at - now);
+            wait = wait < 0 ? due : qMin(wait, due);
+        }
+        if (wait < 0) {
+            changed.wait(&mutex);
+        } else {
+            changed.wait(&mutex, ulong(wait));
+        }
+    }
+}
+
+LONG QPCSCSimulator::connect(SCARDCONTEXT context, LPCSTR name, DWORD mode, DWORD protocols, LPSCARDHANDLE card, LPDWORD protocol) {
+    QMutexLocker locker(&mutex);
+    if (!contexts.contains(context))
+        return SCARD_E_INVALID_HANDLE;
+    applyEvents();
+    Reader *r = find(QString::fromUtf8(name));
+    if (!r || !r->attached)
+        return SCARD_E_UNKNOWN_READER;
+    DWORD proto = 0;
+    if (mode != SCARD_SHARE_DIRECT) {
+        if (!r->present)
+            return SCARD_E_NO_SMARTCARD;
+        if (r->card.mute)
+            return SCARD_W_UNRESPONSIVE_CARD;
+        if (!(protocols & r->card.protocol))
+            return SCARD_E_PROTO_MISMATCH;
+        proto = r->card.protocol;
+    }
+    for (const auto &h: handles) {
+        if (h.reader == r->name && (h.mode == SCARD_SHARE_EXCLUSIVE || mode == SCARD_SHARE_EXCLUSIVE))
+            return SCARD_E_SHARING_VIOLATION;
+    }
+    Handle h;
+    h.context = context;
+    h.reader = r->name;
+    h.mode = mode;
+    h.protocol = proto;
+    h.generation = r->generation;
+    h.resets = r->resets;
+    *card = ++lastHandle;
+    handles[*card] = h;
+    *protocol = proto;
+    changed.wakeAll();
+    return SCARD_S_SUCCESS;
+}
+
+LONG QPCSCSimulator::reconnect(SCARDHANDLE card, DWORD mode, DWORD protocols, DWORD initialization, LPDWORD protocol) {
+    QMutexLocker locker(&mutex);
+    Handle *h = nullptr;
+    Reader *r = nullptr;
+    LONG rv = check(card, h, r);
+    if (rv == LONG(SCARD_E_INVALID_HANDLE) || rv == LONG(SCARD_E_READER_UNAVAILABLE))
+        return rv;
+    if (!r->present)
+        return SCARD_E_NO_SMARTCARD;
+    if (!(protocols & r->card.protocol))
+        return SCARD_E_PROTO_MISMATCH;
+    for (auto i = handles.constBegin(); i != handles.constEnd(); ++i) {
+        if (i.key() != card && i.value().reader == r->name && (i.value().mode == SCARD_SHARE_EXCLUSIVE || mode == SCARD_SHARE_EXCLUSIVE))
+            return SCARD_E_SHARING_VIOLATION;
+    }
+    if (initialization != SCARD_LEAVE_CARD) {
+        r->resets++;
+        reset(*r);
+    }
+    h->mode = mode;
+    h->protocol = r->card.protocol;
+    h->generation = r->generation;
+    h->resets = r->resets;
+    *protocol = h->protocol;
+    changed.wakeAll();
+    return SCARD_S_SUCCESS;
+}
+
+LONG QPCSCSimulator::disconnect(SCARDHANDLE card, DWORD disposition) {
+    QMutexLocker locker(&mutex);
+    if (!handles.contains(card))
+        return SCARD_E_INVALID_HANDLE;
+    Reader *r = find(handles.take(card).reader);
+    if (r) {
+        if (r->transaction == card)
+            r->transaction = 0;
+        if (disposition != SCARD_LEAVE_CARD && r->present) {
+            r->resets++;
+            reset(*r);
+        }
+    }
+    changed.wakeAll();
+    return SCARD_S_SUCCESS;
+}
+
+LONG QPCSCSimulator::beginTransaction(SCARDHANDLE card) {
+    QMutexLocker locker(&mutex);
+    for (;;) {
+        Handle *h = nullptr;
+        Reader *r = nullptr;
+        LONG rv = check(card, h, r);
+        if (rv != SCARD_S_SUCCESS)
+            return rv;
+        if (r->transaction == 0 || r->transaction == card) {
+            r->transaction = card;
+            return SCARD_S_SUCCESS;
+        }
+        changed.wait(&mutex);
+    }
+}
+
+LONG QPCSCSimulator::endTransaction(SCARDHANDLE card, DWORD disposition) {
+    QMutexLocker locker(&mutex);
+    if (!handles.contains(card))
+        return SCARD_E_INVALID_HANDLE;
+    Reader *r = find(handles[card].reader);
+    if (!r || r->transaction != card)
+        return SCARD_E_NOT_TRANSACTED;
+    r->transaction = 0;
+    if (disposition != SCARD_LEAVE_CARD && r->present) {
+        r->resets++;
+        reset(*r);
+    }
+    changed.wakeAll();
+    return SCARD_S_SUCCESS;
+}
+
+LONG QPCSCSimulator::status(SCARDHANDLE card, LPSTR names, LPDWORD namesize, LPDWORD state, LPDWORD protocol, LPBYTE atr, LPDWORD atrsize) {
+    QMutexLocker locker(&mutex);
+    Handle *h = nullptr;
+    Reader *r = nullptr;
+    LONG rv = check(card, h, r);
+    if (rv != SCARD_S_SUCCESS)
+        return rv;
+    QByteArray name = r->name.toUtf8() + QByteArray(2, 0);
+    if (names != nullptr && *namesize < DWORD(name.size())) {
+        *namesize = DWORD(name.size());
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    if (atr != nullptr && *atrsize < DWORD(r->card.atr.size())) {
+        *atrsize = DWORD(r->card.atr.size());
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    if (names != nullptr)
+        memcpy(names, name.constData(), size_t(name.size()));
+    *namesize = DWORD(name.size());
+    if (atr != nullptr)
+        memcpy(atr, r->card.atr.constData(), size_t(r->card.atr.size()));
+    *atrsize = DWORD(r->card.atr.size());
+    *state = SCARD_SPECIFIC;
+    *protocol = h->protocol;
+    return SCARD_S_SUCCESS;
+}
+
+LONG QPCSCSimulator::transmit(SCARDHANDLE card, const BYTE *send, DWORD sendsize, LPBYTE recv, LPDWORD recvsize) {
+    QMutexLocker locker(&mutex);
+    Handle *h = nullptr;
+    Reader *r = nullptr;
+    LONG rv = check(card, h, r);
+    if (rv != SCARD_S_SUCCESS)
+        return rv;
+    if (h->protocol == 0)
+        return SCARD_E_PROTO_MISMATCH;
+    if (r->transaction != 0 && r->transaction != card)
+        return SCARD_E_SHARING_VIOLATION;
+    int latency = 0;
+    QByteArray response = process(*r, QByteArray(reinterpret_cast<const char *>(send), int(sendsize)), latency);
+    if (*recvsize < DWORD(response.size()))
+        return SCARD_E_INSUFFICIENT_BUFFER;
+    memcpy(recv, response.constData(), size_t(response.size()));
+    *recvsize = DWORD(response.size());
+    // The card is busy, the simulator is not
+    locker.unlock();
+    if (latency > 0)
+        QThread::usleep(ulong(latency));
+    return SCARD_S_SUCCESS;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2017 Martin Paljak
+ */
+
+#pragma once
+
+#include "qpcsc.h"
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QMap>
+#include <QList>
+
+/*
+ Simulated PC/SC subsystem with virtual readers and scriptable cards.
+ Selected with --simulate <file> or WEB_EID_SIMULATE=<file>, where the
+ file describes the readers, cards and timed events:
+
+ {
+   "readers": [{
+     "name": "Simulated Reader",
+     "card": {
+       "atr": "3BFA1800008031FE45FE654944202F20504B4903",
+       "protocol": "T=1",
+       "latency": 5,
+       "mute": false,
+       "getResponse": false,
+       "channels": 4,
+       "apdus": [{"command": "00A4040C", "response": "9000", "latency": 20}],
+       "files": {"3F00": "", "3F00EEEE": "", "3F00EEEE5044": "0102..."}
+     }
+   }],
+   "events": [{"at": 3000, "reader": "Simulated Reader", "event": "remove"}]
+ }
+
+ APDUs are matched against the table first (a trailing * matches a prefix),
+ then against the file model (SELECT, READ BINARY, GET RESPONSE) and
+ MANAGE CHANNEL. Each logical channel has its own selected file, and the
+ table is matched with the channel bits of the class cleared.
+ Latency is in milliseconds per APDU and event times are from loading.
+
+ An exported APDU trace (see apdutrace.h) is replayed with "trace": <file>,
+ or by giving the trace file itself. Each traced reader gets a card that
+ answers with the recorded responses in order, with the recorded duration
+ or without latency if "traceLatency" is false.
+*/
+class QPCSCSimulator {
+public:
+    // Loads the configuration and installs the simulator as the PC/SC backend
+    static bool load(const QString &path);
+    static QPCSCSimulator *instance();
+    static bool isActive();
+
+private:
+    struct APDU {
+        QByteArray command;
+        bool prefix = false; // command is a prefix
+        QByteArray response;
+        int latency = -1; // microseconds, card default if negative
+    };
+    struct Card {
+        QByteArray atr;
+        DWORD protocol = SCARD_PROTOCOL_T1;
+        int latency = 0; // microseconds
+        bool mute = false;
+        bool getResponse = false; // answer SELECT with 61xx
+        int channels = 4; // logical channels, with the basic one
+        QList<APDU> apdus;
+        QMap<QByteArray, QByteArray> files; // path of FID-s => contents
+        QList<APDU> replay; // answered in order, regardless of the command
+    };
+    struct Reader {
+        QString name;
+        bool attached = true;
+        bool present = false;
+        Card card;
+        quint16 events = 0; // counter in the high word of the state
+        quint32 generation = 0; // incremented on insertion
+        quint32 resets = 0;
+        SCARDHANDLE transaction = 0;
+        // Card state, by open logical channel
+        struct Channel {
+            QByteArray selected; // path
+            QByteArray pending; // for GET RESPONSE
+        };
+        QMap<int, Channel> channels;
+        int replayed = 0;
+    };
+    struct Handle {
+        SCARDCONTEXT context;
+        QString reader;
+        DWORD mode;
+        DWORD protocol;
+        quint32 generation;
+        quint32 resets;
+    };
+    struct Event {
+        qint64 at;
+        QString reader;
+        QString event;
+        QJsonObject card;
+    };
+
+    static Card parseCard(const QJsonObject &card);
+    bool loadTrace(const QByteArray &data, bool timings);
+    Reader *find(const QString &name);
+    LONG check(SCARDHANDLE card, Handle *&handle, Reader *&reader);
+    void applyEvents();
+    void apply(const Event &event);
+    void reset(Reader &reader);
+    QByteArray process(Reader &reader, const QByteArray &apdu, int &latency);
+
+    LONG establishContext(LPSCARDCONTEXT context);
+    LONG releaseContext(SCARDCONTEXT context);
+    LONG cancel(SCARDCONTEXT context);
+    LONG listReaders(SCARDCONTEXT context, LPSTR readers, LPDWORD size);
+    LONG getStatusChange(SCARDCONTEXT context, DWORD timeout, SCARD_READERSTATE *states, DWORD count);
+    LONG connect(SCARDCONTEXT context, LPCSTR reader, DWORD mode, DWORD protocols, LPSCARDHANDLE card, LPDWORD protocol);
+    LONG reconnect(SCARDHANDLE card, DWORD mode, DWORD protocols, DWORD initialization, LPDWORD protocol);
+    LONG disconnect(SCARDHANDLE card, DWORD disposition);
+    LONG beginTransaction(SCARDHANDLE card);
+    LONG endTransaction(SCARDHANDLE card, DWORD disposition);
+    LONG status(SCARDHANDLE card, LPSTR names, LPDWORD namesize, LPDWORD state, LPDWORD protocol, LPBYTE atr, LPDWORD atrsize);
+    LONG transmit(SCARDHANDLE card, const BYTE *send, DWORD sendsize, LPBYTE recv, LPDWORD recvsize);
+
+    QMutex mutex;
+    QWaitCondition changed; // state changes and released transactions
+    QElapsedTimer clock;
+    QList<Reader> readers;
+    QList<Event> events; // sorted by time
+    QMap<SCARDCONTEXT, bool> contexts; // => cancelled
+    QMap<SCARDHANDLE, Handle> handles;
+    quint16 version = 0; // of the reader list, for PnP notification
+    SCARDCONTEXT lastContext = 0;
+    SCARDHANDLE lastHandle = 0;
+    bool active = false;
+};
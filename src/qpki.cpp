@@ -80,7 +80,8 @@ void QPKIWorker::sign(const QByteArray &cert, const QByteArray &hash) {
 /////////// QPKI
 
 
-void QPKI::handleCardInserted(const QString &reader, const QByteArray &atr) {
+void QPKI::handleCardInserted(const QString &reader, const QPCSCReaderState &state) {
+    const QByteArray &atr = state.atr;
     _log("Card inserted to %s (%s), refreshing available certificates", qPrintable(reader), qPrintable(atr.toHex()));
     // Check if module already present
     QStringList mods = CardOracle::atrOracle(atr);
@@ -118,7 +118,7 @@ public:
 
     void updateCertificates(const QMap<QByteArray, P11Token> certs);
 
-    void handleCardInserted(const QString &reader, const QByteArray &atr);
+    void handleCardInserted(const QString &reader, const QPCSCReaderState &state);
     void handleCardRemoved(const QString &reader);
 
 
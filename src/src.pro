@@ -42,11 +42,13 @@ win32 {
 DEFINES += VERSION=\\\"$$VERSION\\\"
 DEFINES += "GIT_REVISION=\"\\\"$$system(git describe --tags --always)\\\"\""
 SOURCES += \
+    apdutrace.cpp \
     debuglog.cpp \
     oracle.cpp \
     pkcs11module.cpp \
     main.cpp \
     qpcsc.cpp \
+    qpcscsim.cpp \
     qpki.cpp \
     autostart.cpp \
     webextension.cpp \
@@ -15,6 +15,27 @@ class TestPCSC(ChromeTest):
       cmd = {"SCardDisconnect": {}, "origin": "https://example.com/"}
       resp = self.transact(cmd)
 
+  def test_pcsc_batch(self):
+      cmd = {"SCardConnect": {"protocol": "*"}, "origin": "https://example.com"}
+      resp = self.transact(cmd)
+      apdus = ["AKQEAAA=", "AKQEAAA=", "AKQEAAA="] # 00a4040000
+      cmd = {"SCardTransmit": {"reader": resp["name"], "bytes": apdus}, "origin": "https://example.com"}
+      batch = self.transact(cmd)
+      self.assertEqual(len(batch["bytes"]), len(apdus))
+      cmd = {"SCardDisconnect": {"reader": resp["name"]}, "origin": "https://example.com"}
+      resp = self.transact(cmd)
+
+  def test_pcsc_script(self):
+      cmd = {"SCardConnect": {"protocol": "*"}, "origin": "https://example.com"}
+      resp = self.transact(cmd)
+      # second step runs only if the first one fails, third one aborts the script
+      script = [{"bytes": "AKQEAAA="}, {"bytes": "AKQEAAA=", "unless": 0}, {"bytes": "AKQEAAA=", "expect": "6A82", "abort": True}]
+      cmd = {"SCardTransmit": {"reader": resp["name"], "script": script}, "origin": "https://example.com"}
+      result = self.transact(cmd)
+      self.assertEqual(len(result["bytes"]), len(script))
+      cmd = {"SCardDisconnect": {"reader": resp["name"]}, "origin": "https://example.com"}
+      resp = self.transact(cmd)
+
 #  def test_pcsc_card_removal(self):
 #     self.instruct("Select a reader, insert card, remove during apdu-s")
 #     cmd = {"SCardConnect": {"protocol": "*"}, "origin": "https://example.com/"}
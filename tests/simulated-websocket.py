@@ -0,0 +1,148 @@
+# Copyright (C) 2017 Martin Paljak
+
+# Tests of the WebSocket protocol against the simulated readers of
+# simulated.json, with websocket-client and, for CBOR, cbor2. The app is
+# started by the bridge with WEB_EID_SIMULATE set, so no other instance
+# may be running.
+
+import binascii
+import json
+import os
+import struct
+import subprocess
+import unittest
+import uuid
+import websocket
+import testconf
+try:
+    import cbor2
+except ImportError:
+    cbor2 = None
+from simulated import Bridge, READER, b64, unb64
+
+URL = "ws://127.0.0.1:59735/"
+ORIGIN = "https://example.com"
+
+# Opcodes of binary frames
+TRANSMIT = 0x01
+RESPONSE = 0x81
+ERROR = 0xFF
+
+def unhex(hex):
+    return binascii.unhexlify(hex)
+
+class TestWebSocket(unittest.TestCase):
+
+  @classmethod
+  def setUpClass(cls):
+      os.environ["WEB_EID_SIMULATE"] = os.path.abspath(os.path.join(os.path.dirname(__file__), "simulated.json"))
+      # The app is listening once the bridge gets an answer
+      cls.bridge = Bridge()
+      cls.bridge.transact({"version": {}})
+
+  @classmethod
+  def tearDownClass(cls):
+      cls.bridge.close()
+      subprocess.call([testconf.get_exe(), "--quit"])
+
+  def setUp(self):
+      self.ws = websocket.create_connection(URL, origin=ORIGIN)
+
+  def tearDown(self):
+      self.ws.close()
+
+  # Returns the id, the reply is read with receive()
+  def send(self, msg):
+      if not "id" in msg: msg["id"] = str(uuid.uuid4())
+      print("SEND: %s" % json.dumps(msg))
+      self.ws.send(json.dumps(msg))
+      return msg["id"]
+
+  # CBOR replies are maps in binary frames
+  def receive(self):
+      data = self.ws.recv()
+      if isinstance(data, bytes) and 0xA0 <= bytearray(data)[0] <= 0xBF:
+          response = cbor2.loads(data)
+          print("RECV: %r" % response)
+          return response
+      response = json.loads(data)
+      print("RECV: %s" % json.dumps(response))
+      return response
+
+  def transact(self, msg):
+      id = self.send(msg)
+      response = self.receive()
+      self.assertEqual(response["id"], id)
+      return response
+
+  # u8 opcode, u8 reader index, u32 id in network order, payload
+  def sendFrame(self, opcode, index, id, payload=b""):
+      self.ws.send_binary(struct.pack(">BBI", opcode, index, id) + payload)
+
+  def receiveFrame(self):
+      frame = self.ws.recv()
+      self.assertTrue(isinstance(frame, bytes))
+      opcode, index, id = struct.unpack(">BBI", frame[:6])
+      return (opcode, index, id, frame[6:])
+
+  def connectBinary(self):
+      self.assertTrue(self.transact({"binary": True})["binary"])
+      resp = self.transact({"SCardConnect": {"reader": READER, "protocol": "*", "implicitTransaction": False}})
+      self.assertEqual(resp["name"], READER)
+      return resp["index"]
+
+  def test_binary_transmit(self):
+      index = self.connectBinary()
+      self.assertEqual(index, 0)
+      self.sendFrame(TRANSMIT, index, 1, unhex("00CA0001"))
+      self.assertEqual(self.receiveFrame(), (RESPONSE, index, 1, unhex("019000")))
+      # JSON requests go on alongside
+      resp = self.transact({"SCardTransmit": {"reader": READER, "bytes": b64("00CA0002")}})
+      self.assertEqual(unb64(resp["bytes"]), "029000")
+      # Pipelined, every response has the id of its request
+      self.sendFrame(TRANSMIT, index, 0xFFFFFFFF, unhex("00CA0003"))
+      self.sendFrame(TRANSMIT, index, 2, unhex("00CA0004"))
+      self.assertEqual(self.receiveFrame(), (RESPONSE, index, 0xFFFFFFFF, unhex("039000")))
+      self.assertEqual(self.receiveFrame(), (RESPONSE, index, 2, unhex("049000")))
+
+  def test_binary_errors(self):
+      index = self.connectBinary()
+      # No reader behind the index
+      self.sendFrame(TRANSMIT, index + 1, 3, unhex("00CA0001"))
+      self.assertEqual(self.receiveFrame(), (ERROR, index + 1, 3, b"SCARD_E_READER_UNAVAILABLE"))
+      # Unknown opcode
+      self.sendFrame(0x02, index, 4, unhex("00CA0001"))
+      self.assertEqual(self.receiveFrame(), (ERROR, index, 4, b"protocol"))
+      # The ids of binary frames are reserved
+      resp = self.transact({"id": "binary:5", "SCardTransmit": {"reader": READER, "bytes": b64("00CA0001")}})
+      self.assertEqual(resp["error"], "protocol")
+
+  def test_binary_not_negotiated(self):
+      self.sendFrame(TRANSMIT, 0, 1, unhex("00CA0001"))
+      # The connection is dropped
+      self.assertRaises((websocket.WebSocketException, OSError), self.ws.recv)
+
+  @unittest.skipIf(cbor2 is None, "needs cbor2")
+  def test_cbor(self):
+      # The reply to the switch is still JSON
+      self.assertTrue(self.transact({"cbor": True})["cbor"])
+      resp = self.transact({"SCardConnect": {"reader": READER, "protocol": "*", "implicitTransaction": False}})
+      self.assertEqual(resp["name"], READER)
+      self.assertEqual(resp["atr"], unhex("3BFA1800008031FE45FE654944202F20504B4903"))
+      # CBOR request, bytes as byte strings
+      self.ws.send_binary(cbor2.dumps({"id": "1", "SCardTransmit": {"reader": READER, "bytes": unhex("00CA0001")}}))
+      resp = self.receive()
+      self.assertEqual(resp["id"], "1")
+      self.assertEqual(resp["bytes"], unhex("019000"))
+      # JSON requests are still taken, the reply is CBOR
+      resp = self.transact({"SCardTransmit": {"reader": READER, "bytes": b64("00CA0002")}})
+      self.assertEqual(resp["bytes"], unhex("029000"))
+
+  def test_cbor_bridge(self):
+      # Browsers only take JSON from the bridge
+      self.assertFalse(self.bridge.transact({"cbor": True})["cbor"])
+      self.assertTrue("version" in self.bridge.transact({"version": {}}))
+
+if __name__ == '__main__':
+    # run tests
+    unittest.main()
@@ -0,0 +1,204 @@
+# Copyright (C) 2017 Martin Paljak
+
+# Unattended tests against the simulated readers of simulated.json.
+# The app is started by the bridge with WEB_EID_SIMULATE set, so no other
+# instance may be running. Every Bridge is a browser context, like a tab.
+
+import base64
+import binascii
+import json
+import os
+import struct
+import subprocess
+import sys
+import time
+import unittest
+import uuid
+import testconf
+
+READER = "Simulated Reader 0"
+
+def b64(hex):
+    return base64.b64encode(binascii.unhexlify(hex)).decode('ascii')
+
+def unb64(data):
+    return binascii.hexlify(base64.b64decode(data)).decode('ascii').upper()
+
+class Bridge(object):
+  def __init__(self, origin="https://example.com"):
+      self.origin = origin
+      should_close_fds = sys.platform.startswith('win32') == False;
+      self.p = subprocess.Popen([testconf.get_exe(), "chrome-extension://fmpfihjoladdfajbnkdfocnbcehjpogi"], stdin=subprocess.PIPE, stdout=subprocess.PIPE, close_fds=should_close_fds, stderr=None)
+
+  # Returns the id, the reply is read with receive()
+  def send(self, msg):
+      if not "id" in msg: msg["id"] = str(uuid.uuid4())
+      if not "origin" in msg: msg["origin"] = self.origin
+      data = json.dumps(msg).encode('utf-8')
+      print("SEND: %s" % data)
+      self.p.stdin.write(struct.pack("=I", len(data)))
+      self.p.stdin.write(data)
+      self.p.stdin.flush()
+      return msg["id"]
+
+  def receive(self):
+      length = struct.unpack("=I", self.p.stdout.read(4))[0]
+      response = json.loads(self.p.stdout.read(length).decode('utf-8'))
+      print("RECV: %s" % json.dumps(response))
+      return response
+
+  def transact(self, msg):
+      id = self.send(msg)
+      response = self.receive()
+      assert response["id"] == id
+      return response
+
+  def connect(self, **options):
+      params = {"reader": READER, "protocol": "*", "implicitTransaction": False}
+      params.update(options)
+      return self.transact({"SCardConnect": params})
+
+  def close(self):
+      self.p.stdin.close()
+      self.p.wait()
+
+class TestSimulated(unittest.TestCase):
+
+  @classmethod
+  def setUpClass(cls):
+      os.environ["WEB_EID_SIMULATE"] = os.path.abspath(os.path.join(os.path.dirname(__file__), "simulated.json"))
+
+  @classmethod
+  def tearDownClass(cls):
+      subprocess.call([testconf.get_exe(), "--quit"])
+
+  def setUp(self):
+      self.bridges = []
+
+  def tearDown(self):
+      for b in self.bridges:
+          b.close()
+
+  def tab(self, **options):
+      b = Bridge()
+      self.bridges.append(b)
+      resp = b.connect(**options)
+      self.assertEqual(resp["name"], READER)
+      return b
+
+  def transmit(self, b, apdu):
+      return b.send({"SCardTransmit": {"reader": READER, "bytes": b64(apdu)}})
+
+  def assertReply(self, resp, id, expected=None):
+      self.assertEqual(resp["id"], id)
+      self.assertFalse("error" in resp)
+      if expected is not None:
+          self.assertEqual(unb64(resp["bytes"]), expected)
+
+  def test_simulated_card(self):
+      b = Bridge()
+      self.bridges.append(b)
+      resp = b.transact({"SCardConnect": {"reader": READER, "protocol": "*"}})
+      self.assertEqual(resp["name"], READER)
+      self.assertEqual(resp["protocol"], "T=1")
+      self.assertEqual(unb64(resp["atr"]), "3BFA1800008031FE45FE654944202F20504B4903")
+      # from the APDU table
+      id = self.transmit(b, "00A4040000")
+      self.assertReply(b.receive(), id, "9000")
+      # from the file model
+      id = self.transmit(b, "00A40000023F00")
+      resp = b.receive()
+      self.assertEqual(resp["id"], id)
+      self.assertEqual(unb64(resp["bytes"])[-4:], "9000")
+
+  def test_transaction(self):
+      a = self.tab()
+      b = self.tab()
+      self.assertFalse("error" in a.transact({"SCardBeginTransaction": {"reader": READER}}))
+      # waits for a to end
+      begin = b.send({"SCardBeginTransaction": {"reader": READER}})
+      id = self.transmit(a, "00CA0001")
+      self.assertReply(a.receive(), id, "019000")
+      self.assertFalse("error" in a.transact({"SCardEndTransaction": {"reader": READER}}))
+      self.assertReply(b.receive(), begin)
+      id = self.transmit(b, "00CA0002")
+      self.assertReply(b.receive(), id, "029000")
+      self.assertFalse("error" in b.transact({"SCardEndTransaction": {"reader": READER}}))
+      # ending again is an error
+      self.assertEqual(b.transact({"SCardEndTransaction": {"reader": READER}})["error"], "SCARD_E_NOT_TRANSACTED")
+
+  def test_scheduler_order(self):
+      a = self.tab()
+      b = self.tab()
+      # Pipelined, the two contexts take turns on the reader
+      sent = []
+      for i in range(1, 5):
+          sent.append((a, self.transmit(a, "00CA000%d" % i), "0%d9000" % i))
+          sent.append((b, self.transmit(b, "00CA000%d" % (5 - i)), "0%d9000" % (5 - i)))
+      # Every reply goes to its own request, in order per context
+      for tab, id, expected in sent:
+          self.assertReply(tab.receive(), id, expected)
+
+  def test_readfile(self):
+      a = self.tab()
+      # several READ BINARY-s of 4 bytes
+      resp = a.transact({"readFile": {"reader": READER, "path": "3F00EEEE5044", "chunk": 4}})
+      self.assertEqual(unb64(resp["bytes"]), "4D414E4E45524D41412C4D415454499000")
+      resp = a.transact({"readFile": {"reader": READER, "path": "3F00EEEE0000"}})
+      self.assertEqual(resp["error"], "card")
+      self.assertEqual(resp["sw"], "6A82")
+
+  def test_logical_channel(self):
+      a = self.tab(logicalChannel=True)
+      b = self.tab(logicalChannel=True)
+      # a selects the EF on the basic channel, b is on its own channel at the MF
+      for apdu in ["00A4000C02EEEE", "00A4000C025044"]:
+          id = self.transmit(a, apdu)
+          self.assertReply(a.receive(), id, "9000")
+      id = self.transmit(b, "00B0000004")
+      self.assertReply(b.receive(), id, "6986")
+      id = self.transmit(a, "00B0000004")
+      self.assertReply(a.receive(), id, "4D414E4E9000")
+      id = self.transmit(b, "00CA0001")
+      self.assertReply(b.receive(), id, "019000")
+      # A transaction on the shared card, ended by the last one in it
+      self.assertFalse("error" in b.transact({"SCardBeginTransaction": {"reader": READER}}))
+      self.assertFalse("error" in a.transact({"SCardBeginTransaction": {"reader": READER}}))
+      self.assertFalse("error" in b.transact({"SCardEndTransaction": {"reader": READER}}))
+      self.assertEqual(b.transact({"SCardEndTransaction": {"reader": READER}})["error"], "SCARD_E_NOT_TRANSACTED")
+      self.assertFalse("error" in a.transact({"SCardEndTransaction": {"reader": READER}}))
+      # Proprietary classes have no channel bits
+      self.assertTrue("error" in b.transact({"SCardTransmit": {"reader": READER, "bytes": b64("80CA0001")}}))
+      # The basic channel goes on when the other one leaves
+      self.bridges.remove(b)
+      b.close()
+      id = self.transmit(a, "00B0000404")
+      self.assertReply(a.receive(), id, "45524D419000")
+
+  def test_deferred_order(self):
+      a = self.tab()
+      b = self.tab()
+      self.assertFalse("error" in a.transact({"SCardBeginTransaction": {"reader": READER}}))
+      # Everything below is queued while the card is busy with this one
+      slow = self.transmit(a, "00CA0009")
+      time.sleep(0.1)
+      # Turns are a, b, a, b, a, b: a ends its transaction when the first
+      # transmit of b has been deferred and the second one is still queued
+      t2 = self.transmit(a, "00CA0001")
+      t3 = self.transmit(a, "00CA0002")
+      end = a.send({"SCardEndTransaction": {"reader": READER}})
+      begin = b.send({"SCardBeginTransaction": {"reader": READER}})
+      x = self.transmit(b, "00CA0003")
+      y = self.transmit(b, "00CA0004")
+      self.assertReply(a.receive(), slow, "099000")
+      self.assertReply(a.receive(), t2, "019000")
+      self.assertReply(a.receive(), t3, "029000")
+      self.assertReply(a.receive(), end)
+      self.assertReply(b.receive(), begin)
+      self.assertReply(b.receive(), x, "039000")
+      self.assertReply(b.receive(), y, "049000")
+      self.assertFalse("error" in b.transact({"SCardEndTransaction": {"reader": READER}}))
+
+if __name__ == '__main__':
+    # run tests
+    unittest.main()
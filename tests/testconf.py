@@ -10,7 +10,7 @@ def get_exe():
     if sys.platform == 'darwin':
         os.environ["WEB_EID_APP"] = "src/Web eID.app/Contents/MacOS/Web eID"
         return "src/nm-bridge/web-eid-bridge"
-    elif sys.platform == "linux2":
+    elif sys.platform.startswith("linux"):
         os.environ["WEB_EID_APP"] = "src/web-eid"
         return "src/nm-bridge/web-eid-bridge"
     elif sys.platform == 'win32':
@@ -1,2 +1,2 @@
 TEMPLATE = subdirs
-SUBDIRS += src/nm-bridge src
+SUBDIRS += src/nm-bridge src src/bench